@@ -0,0 +1,490 @@
+/*
+ * blake3.cpp BLAKE3 Hashing on the CPU
+ *
+ * Each SIMD lane runs the compression function of the BLAKE3 specification
+ * on the blocks of its own chunk, so the chunks of one call must all have
+ * the same length. Parents are few, one per chunk at most, and are
+ * compressed one at a time.
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "blake3.h"
+
+namespace {
+
+const size_t kChunkLen = 1024;
+const size_t kBlockLen = 64;
+const size_t kOutLen = 32;
+
+// domain separation flags; plain constants rather than an enum so that they
+// mix with 0 in conditionals
+const uint32_t CHUNK_START = 1;
+const uint32_t CHUNK_END = 2;
+const uint32_t PARENT = 4;
+const uint32_t ROOT = 8;
+
+const uint32_t iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// the message words each round reads, in order: msg_schedule[r][i] is
+// the index of the i-th word of round r
+const uint8_t msg_schedule[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+struct ChainingValue {
+  uint32_t words[8];
+};
+
+enum Kernel {
+  KERNEL_PORTABLE,
+  KERNEL_AVX2,
+  KERNEL_AVX512
+};
+
+inline uint32_t load_le32(const unsigned char* p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+inline void store_le32(unsigned char* p, uint32_t word) {
+  memcpy(p, &word, sizeof(word));
+}
+
+inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+// the block b of a chunk of len bytes, zero-padded if it is short, and the
+// number of bytes of the chunk in it
+const unsigned char* chunk_block(const unsigned char* chunk, size_t len,
+                                 size_t b, unsigned char padded[kBlockLen],
+                                 uint32_t& block_len) {
+  size_t offset = b * kBlockLen;
+  block_len = (uint32_t)std::min(kBlockLen, len - offset);
+  if (block_len == kBlockLen) {
+    return chunk + offset;
+  }
+  memset(padded, 0, kBlockLen);
+  memcpy(padded, chunk + offset, block_len);
+  return padded;
+}
+
+// blocks in a chunk of len bytes; an empty chunk still has one empty block
+size_t num_of_chunk_blocks(size_t len) {
+  return len == 0 ? 1 : (len + kBlockLen - 1) / kBlockLen;
+}
+
+//
+// Portable: one chunk at a time
+//
+inline void g(uint32_t v[16], int a, int b, int c, int d, uint32_t mx,
+              uint32_t my) {
+  v[a] += v[b] + mx;
+  v[d] = rotr(v[d] ^ v[a], 16);
+  v[c] += v[d];
+  v[b] = rotr(v[b] ^ v[c], 12);
+  v[a] += v[b] + my;
+  v[d] = rotr(v[d] ^ v[a], 8);
+  v[c] += v[d];
+  v[b] = rotr(v[b] ^ v[c], 7);
+}
+
+// compress a block into the chaining value cv, in place
+void compress(uint32_t cv[8], const uint32_t m[16], uint64_t counter,
+              uint32_t block_len, uint32_t flags) {
+  uint32_t v[16] = {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    iv[0], iv[1], iv[2], iv[3],
+    (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags
+  };
+  for (int r = 0; r < 7; r++) {
+    const uint8_t* s = msg_schedule[r];
+    g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+    g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+    g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+    g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+    g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+    g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+    g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+  }
+  for (int i = 0; i < 8; i++) {
+    cv[i] = v[i] ^ v[i + 8];
+  }
+}
+
+// the chaining value of a chunk of len bytes, or the hash of the message if
+// flags has ROOT and the chunk is the whole message
+void hash_chunk(const unsigned char* chunk, size_t len, uint64_t counter,
+                uint32_t flags, uint32_t cv[8]) {
+  memcpy(cv, iv, sizeof(iv));
+  size_t num_of_blocks = num_of_chunk_blocks(len);
+  for (size_t b = 0; b < num_of_blocks; b++) {
+    unsigned char padded[kBlockLen];
+    uint32_t block_len;
+    const unsigned char* block = chunk_block(chunk, len, b, padded, block_len);
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) {
+      m[i] = load_le32(block + i * 4);
+    }
+    uint32_t block_flags = (b == 0 ? CHUNK_START : 0) |
+                           (b + 1 == num_of_blocks ? CHUNK_END | flags : 0);
+    compress(cv, m, counter, block_len, block_flags);
+  }
+}
+
+// the chaining value of the parent of two chaining values
+void hash_parent(const uint32_t left[8], const uint32_t right[8],
+                 uint32_t flags, uint32_t cv[8]) {
+  uint32_t m[16];
+  memcpy(m, left, 32);
+  memcpy(m + 8, right, 32);
+  memcpy(cv, iv, sizeof(iv));
+  compress(cv, m, 0, kBlockLen, PARENT | flags);
+}
+
+//
+// AVX2: 8 lanes
+//
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256i rotr16_x8(__m256i x) {
+  const __m256i r16 = _mm256_setr_epi8(
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  return _mm256_shuffle_epi8(x, r16);
+}
+
+AVX2 inline __m256i rotr8_x8(__m256i x) {
+  const __m256i r8 = _mm256_setr_epi8(
+      1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+      1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+  return _mm256_shuffle_epi8(x, r8);
+}
+
+AVX2 inline __m256i rotr_x8(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+AVX2 inline void g_x8(__m256i v[16], int a, int b, int c, int d, __m256i mx,
+                      __m256i my) {
+  v[a] = _mm256_add_epi32(v[a], _mm256_add_epi32(v[b], mx));
+  v[d] = rotr16_x8(_mm256_xor_si256(v[d], v[a]));
+  v[c] = _mm256_add_epi32(v[c], v[d]);
+  v[b] = rotr_x8(_mm256_xor_si256(v[b], v[c]), 12);
+  v[a] = _mm256_add_epi32(v[a], _mm256_add_epi32(v[b], my));
+  v[d] = rotr8_x8(_mm256_xor_si256(v[d], v[a]));
+  v[c] = _mm256_add_epi32(v[c], v[d]);
+  v[b] = rotr_x8(_mm256_xor_si256(v[b], v[c]), 7);
+}
+
+// hash 8 chunks of len bytes, with their chunk counters, into cvs
+AVX2 void hash_chunks_x8(const unsigned char* const chunks[8], size_t len,
+                         const uint64_t counters[8], uint32_t flags,
+                         ChainingValue cvs[8]) {
+  __m256i cv[8];
+  for (int i = 0; i < 8; i++) {
+    cv[i] = _mm256_set1_epi32(iv[i]);
+  }
+  alignas(32) uint32_t counter_lo[8], counter_hi[8];
+  for (int lane = 0; lane < 8; lane++) {
+    counter_lo[lane] = (uint32_t)counters[lane];
+    counter_hi[lane] = (uint32_t)(counters[lane] >> 32);
+  }
+  size_t num_of_blocks = num_of_chunk_blocks(len);
+  for (size_t b = 0; b < num_of_blocks; b++) {
+    unsigned char padded[8][kBlockLen];
+    const unsigned char* blocks[8];
+    uint32_t block_len = 0;
+    for (int lane = 0; lane < 8; lane++) {
+      blocks[lane] = chunk_block(chunks[lane], len, b, padded[lane],
+                                 block_len);
+    }
+    __m256i m[16];
+    for (int i = 0; i < 16; i++) {
+      m[i] = _mm256_setr_epi32(
+          load_le32(blocks[0] + i * 4), load_le32(blocks[1] + i * 4),
+          load_le32(blocks[2] + i * 4), load_le32(blocks[3] + i * 4),
+          load_le32(blocks[4] + i * 4), load_le32(blocks[5] + i * 4),
+          load_le32(blocks[6] + i * 4), load_le32(blocks[7] + i * 4));
+    }
+    uint32_t block_flags = (b == 0 ? CHUNK_START : 0) |
+                           (b + 1 == num_of_blocks ? CHUNK_END | flags : 0);
+    __m256i v[16] = {
+      cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+      _mm256_set1_epi32(iv[0]), _mm256_set1_epi32(iv[1]),
+      _mm256_set1_epi32(iv[2]), _mm256_set1_epi32(iv[3]),
+      _mm256_load_si256((const __m256i*)counter_lo),
+      _mm256_load_si256((const __m256i*)counter_hi),
+      _mm256_set1_epi32(block_len), _mm256_set1_epi32(block_flags)
+    };
+    for (int r = 0; r < 7; r++) {
+      const uint8_t* s = msg_schedule[r];
+      g_x8(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+      g_x8(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+      g_x8(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+      g_x8(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+      g_x8(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+      g_x8(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+      g_x8(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+      g_x8(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+      cv[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+  }
+
+  alignas(32) uint32_t words[8][8];
+  for (int i = 0; i < 8; i++) {
+    _mm256_store_si256((__m256i*)words[i], cv[i]);
+  }
+  for (int lane = 0; lane < 8; lane++) {
+    for (int i = 0; i < 8; i++) {
+      cvs[lane].words[i] = words[i][lane];
+    }
+  }
+}
+
+//
+// AVX-512: 16 lanes
+//
+#define AVX512 __attribute__((target("avx512f")))
+
+// the zero-masked form keeps GCC from warning about the undefined source
+// operand of the plain one; the count is an immediate, so a template argument
+template <int N>
+AVX512 inline __m512i rotr_x16(__m512i x) {
+  return _mm512_maskz_ror_epi32(0xffff, x, N);
+}
+
+AVX512 inline void g_x16(__m512i v[16], int a, int b, int c, int d,
+                         __m512i mx, __m512i my) {
+  v[a] = _mm512_add_epi32(v[a], _mm512_add_epi32(v[b], mx));
+  v[d] = rotr_x16<16>(_mm512_xor_si512(v[d], v[a]));
+  v[c] = _mm512_add_epi32(v[c], v[d]);
+  v[b] = rotr_x16<12>(_mm512_xor_si512(v[b], v[c]));
+  v[a] = _mm512_add_epi32(v[a], _mm512_add_epi32(v[b], my));
+  v[d] = rotr_x16<8>(_mm512_xor_si512(v[d], v[a]));
+  v[c] = _mm512_add_epi32(v[c], v[d]);
+  v[b] = rotr_x16<7>(_mm512_xor_si512(v[b], v[c]));
+}
+
+// hash 16 chunks of len bytes, with their chunk counters, into cvs
+AVX512 void hash_chunks_x16(const unsigned char* const chunks[16], size_t len,
+                            const uint64_t counters[16], uint32_t flags,
+                            ChainingValue cvs[16]) {
+  __m512i cv[8];
+  for (int i = 0; i < 8; i++) {
+    cv[i] = _mm512_set1_epi32(iv[i]);
+  }
+  alignas(64) uint32_t counter_lo[16], counter_hi[16];
+  for (int lane = 0; lane < 16; lane++) {
+    counter_lo[lane] = (uint32_t)counters[lane];
+    counter_hi[lane] = (uint32_t)(counters[lane] >> 32);
+  }
+  size_t num_of_blocks = num_of_chunk_blocks(len);
+  for (size_t b = 0; b < num_of_blocks; b++) {
+    unsigned char padded[16][kBlockLen];
+    const unsigned char* blocks[16];
+    uint32_t block_len = 0;
+    for (int lane = 0; lane < 16; lane++) {
+      blocks[lane] = chunk_block(chunks[lane], len, b, padded[lane],
+                                 block_len);
+    }
+    __m512i m[16];
+    for (int i = 0; i < 16; i++) {
+      alignas(64) uint32_t words[16];
+      for (int lane = 0; lane < 16; lane++) {
+        words[lane] = load_le32(blocks[lane] + i * 4);
+      }
+      m[i] = _mm512_load_si512(words);
+    }
+    uint32_t block_flags = (b == 0 ? CHUNK_START : 0) |
+                           (b + 1 == num_of_blocks ? CHUNK_END | flags : 0);
+    __m512i v[16] = {
+      cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+      _mm512_set1_epi32(iv[0]), _mm512_set1_epi32(iv[1]),
+      _mm512_set1_epi32(iv[2]), _mm512_set1_epi32(iv[3]),
+      _mm512_load_si512(counter_lo), _mm512_load_si512(counter_hi),
+      _mm512_set1_epi32(block_len), _mm512_set1_epi32(block_flags)
+    };
+    for (int r = 0; r < 7; r++) {
+      const uint8_t* s = msg_schedule[r];
+      g_x16(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+      g_x16(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+      g_x16(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+      g_x16(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+      g_x16(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+      g_x16(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+      g_x16(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+      g_x16(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+      cv[i] = _mm512_xor_si512(v[i], v[i + 8]);
+    }
+  }
+
+  alignas(64) uint32_t words[8][16];
+  for (int i = 0; i < 8; i++) {
+    _mm512_store_si512(words[i], cv[i]);
+  }
+  for (int lane = 0; lane < 16; lane++) {
+    for (int i = 0; i < 8; i++) {
+      cvs[lane].words[i] = words[i][lane];
+    }
+  }
+}
+
+Kernel pick_kernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return KERNEL_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return KERNEL_AVX2;
+  }
+  return KERNEL_PORTABLE;
+}
+
+Kernel kernel() {
+  static const Kernel picked = pick_kernel();
+  return picked;
+}
+
+// hash num_of_chunks chunks of len bytes each into cvs, as many at once as
+// the kernel has lanes
+void hash_chunks(const unsigned char* const* chunks, size_t len,
+                 const uint64_t* counters, uint32_t flags,
+                 ChainingValue* cvs, size_t num_of_chunks) {
+  size_t i = 0;
+  if (kernel() == KERNEL_AVX512) {
+    for (; i + 16 <= num_of_chunks; i += 16) {
+      hash_chunks_x16(chunks + i, len, counters + i, flags, cvs + i);
+    }
+  }
+  if (kernel() == KERNEL_AVX512 || kernel() == KERNEL_AVX2) {
+    for (; i + 8 <= num_of_chunks; i += 8) {
+      hash_chunks_x8(chunks + i, len, counters + i, flags, cvs + i);
+    }
+  }
+  for (; i < num_of_chunks; i++) {
+    hash_chunk(chunks[i], len, counters[i], flags, cvs[i].words);
+  }
+}
+
+// merge the chaining values of the num_of_chunks > 1 chunks of a message
+// into its hash. The left subtree of every parent holds the largest power
+// of 2 of chunks that leaves at least one for the right one, which a stack
+// of the complete subtrees so far builds in one pass.
+void merge_chunks(const ChainingValue* cvs, size_t num_of_chunks,
+                  uint32_t hash[8]) {
+  std::vector<ChainingValue> stack;
+  for (size_t i = 0; i + 1 < num_of_chunks; i++) {
+    ChainingValue cv = cvs[i];
+    for (size_t total = i + 1; total % 2 == 0; total /= 2) {
+      hash_parent(stack.back().words, cv.words, 0, cv.words);
+      stack.pop_back();
+    }
+    stack.push_back(cv);
+  }
+  memcpy(hash, cvs[num_of_chunks - 1].words, 32);
+  while (!stack.empty()) {
+    hash_parent(stack.back().words, hash, stack.size() == 1 ? ROOT : 0,
+                hash);
+    stack.pop_back();
+  }
+}
+
+void store_hash(const uint32_t words[8], unsigned char* hash) {
+  for (int i = 0; i < 8; i++) {
+    store_le32(hash + i * 4, words[i]);
+  }
+}
+
+} // namespace
+
+void blake3(const unsigned char* data, size_t msg_len, unsigned char* hash) {
+  // one chunk needs no lanes nor parents
+  if (msg_len <= kChunkLen) {
+    uint32_t words[8];
+    hash_chunk(data, msg_len, 0, ROOT, words);
+    store_hash(words, hash);
+    return;
+  }
+  blake3_multi_buffer(data, msg_len, hash, 1);
+}
+
+void blake3_multi_buffer(const unsigned char* din, size_t msg_len,
+                         unsigned char* dout, size_t num_of_msgs) {
+  size_t chunks_per_msg = msg_len <= kChunkLen
+      ? 1 : (msg_len + kChunkLen - 1) / kChunkLen;
+  size_t last_len = msg_len - (chunks_per_msg - 1) * kChunkLen;
+  if (chunks_per_msg == 1) {
+    // every message is one chunk, which gives its hash directly
+    std::vector<const unsigned char*> chunks(num_of_msgs);
+    std::vector<uint64_t> counters(num_of_msgs, 0);
+    std::vector<ChainingValue> hashes(num_of_msgs);
+    for (size_t i = 0; i < num_of_msgs; i++) {
+      chunks[i] = din + i * msg_len;
+    }
+    hash_chunks(chunks.data(), msg_len, counters.data(), ROOT, hashes.data(),
+                num_of_msgs);
+    for (size_t i = 0; i < num_of_msgs; i++) {
+      store_hash(hashes[i].words, dout + i * kOutLen);
+    }
+    return;
+  }
+  // the full chunks of all messages in one run, then the last ones, which
+  // may be shorter, in another
+  size_t num_of_full = (chunks_per_msg - 1) * num_of_msgs;
+  std::vector<const unsigned char*> chunks(chunks_per_msg * num_of_msgs);
+  std::vector<uint64_t> counters(chunks_per_msg * num_of_msgs);
+  for (size_t i = 0; i < num_of_msgs; i++) {
+    for (size_t c = 0; c + 1 < chunks_per_msg; c++) {
+      chunks[i * (chunks_per_msg - 1) + c] = din + i * msg_len + c * kChunkLen;
+      counters[i * (chunks_per_msg - 1) + c] = c;
+    }
+    chunks[num_of_full + i] = din + i * msg_len + msg_len - last_len;
+    counters[num_of_full + i] = chunks_per_msg - 1;
+  }
+  std::vector<ChainingValue> chunk_cvs(chunks_per_msg * num_of_msgs);
+  hash_chunks(chunks.data(), kChunkLen, counters.data(), 0, chunk_cvs.data(),
+              num_of_full);
+  hash_chunks(chunks.data() + num_of_full, last_len,
+              counters.data() + num_of_full, 0, chunk_cvs.data() + num_of_full,
+              num_of_msgs);
+  std::vector<ChainingValue> msg_cvs(chunks_per_msg);
+  for (size_t i = 0; i < num_of_msgs; i++) {
+    std::copy_n(chunk_cvs.begin() + i * (chunks_per_msg - 1),
+                chunks_per_msg - 1, msg_cvs.begin());
+    msg_cvs.back() = chunk_cvs[num_of_full + i];
+    uint32_t hash[8];
+    merge_chunks(msg_cvs.data(), chunks_per_msg, hash);
+    store_hash(hash, dout + i * kOutLen);
+  }
+}
+
+const char* blake3_multi_buffer_kernel() {
+  switch (kernel()) {
+    case KERNEL_AVX512:
+      return "avx512";
+    case KERNEL_AVX2:
+      return "avx2";
+    default:
+      return "portable";
+  }
+}
@@ -0,0 +1,27 @@
+/*
+ * blake3.h BLAKE3 Hashing on the CPU
+ *
+ * The 32-byte BLAKE3 hash (unkeyed, default output length). A message is cut
+ * into 1 KiB chunks whose chaining values are merged by a binary tree of
+ * parents; a message of one chunk, such as a tree block of up to 1 KiB or
+ * the parent of two digests, is hashed by its chunk alone.
+ *
+ * blake3_multi_buffer() hashes many messages of the same length with one
+ * chunk per SIMD lane: 16 lanes with AVX-512, 8 lanes with AVX2, picked at
+ * runtime. The chunks of a longer message are spread over the lanes as well,
+ * so a single long message is hashed in parallel too.
+ */
+
+#pragma once
+#include <cstddef>
+
+// hash msg_len bytes at data into 32 bytes at hash
+void blake3(const unsigned char* data, size_t msg_len, unsigned char* hash);
+
+// hash num_of_msgs messages of msg_len bytes laid out back to back in din
+// into num_of_msgs 32-byte digests in dout
+void blake3_multi_buffer(const unsigned char* din, size_t msg_len,
+                         unsigned char* dout, size_t num_of_msgs);
+
+// name of the kernel in use: "avx512", "avx2" or "portable"
+const char* blake3_multi_buffer_kernel();
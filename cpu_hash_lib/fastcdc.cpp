@@ -0,0 +1,225 @@
+/*
+ * fastcdc.cpp Content-Defined Chunking on the CPU
+ *
+ * The scanner finds every position whose Gear hash matches the loose mask.
+ * The bits of the loose mask are among those of the strict one, so the
+ * positions matching the strict mask are among them too. The data is scanned
+ * a window at a time, and each SIMD lane hashes its own stretch of the
+ * window, starting 31 bytes early so its hash covers the full 32 bytes from
+ * the first position on.
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include "fastcdc.h"
+
+namespace {
+
+// bytes scanned per window; the lanes split it between them
+const size_t kWindowLen = 1 << 20;
+// bytes hashed before a position for its hash to cover 32 bytes
+const size_t kWarmUpLen = 31;
+// a lane scans at least this many bytes, or the window is scanned serially
+const size_t kMinStretchLen = 256;
+
+enum Kernel {
+  KERNEL_PORTABLE,
+  KERNEL_AVX2
+};
+
+// a position whose hash matches the loose mask, and whether it matches the
+// strict one too
+struct Match {
+  size_t pos;
+  bool strict;
+};
+
+struct Masks {
+  uint32_t strict;
+  uint32_t loose;
+};
+
+// a random 32-bit value per byte, from splitmix64
+constexpr std::array<uint32_t, 256> make_gear_table() {
+  std::array<uint32_t, 256> table{};
+  uint64_t x = 0;
+  for (size_t i = 0; i < table.size(); i++) {
+    x += 0x9e3779b97f4a7c15;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    table[i] = (uint32_t)((z ^ (z >> 31)) >> 32);
+  }
+  return table;
+}
+
+alignas(64) constexpr std::array<uint32_t, 256> gear = make_gear_table();
+
+// the top num_of_bits bits, 1 to 31 of them
+uint32_t top_bits(int num_of_bits) {
+  return ~0u << (32 - num_of_bits);
+}
+
+Masks make_masks(size_t avg_size) {
+  int bits = 63 - __builtin_clzll(avg_size);
+  return {top_bits(std::min(bits + 2, 31)), top_bits(std::max(bits - 2, 1))};
+}
+
+// hash data[begin, end) on from hash, appending the matches, and return the
+// hash at the end
+uint32_t scan(const unsigned char* data, size_t begin, size_t end,
+              uint32_t hash, Masks masks, std::vector<Match>& matches) {
+  for (size_t i = begin; i < end; i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if ((hash & masks.loose) == 0) {
+      matches.push_back({i, (hash & masks.strict) == 0});
+    }
+  }
+  return hash;
+}
+
+// the hash right before pos, from the bytes that still count in it
+uint32_t warm_up(const unsigned char* data, size_t pos) {
+  uint32_t hash = 0;
+  for (size_t i = pos - std::min(pos, kWarmUpLen); i < pos; i++) {
+    hash = (hash << 1) + gear[data[i]];
+  }
+  return hash;
+}
+
+// append the matches of the lanes whose bits are set in hits at position t
+// of their stretches, with hashes the hashes of all lanes
+void add_matches(unsigned int hits, const uint32_t* hashes, size_t stretch_len,
+                 size_t t, Masks masks, std::vector<Match>* matches) {
+  while (hits != 0) {
+    int lane = __builtin_ctz(hits);
+    hits &= hits - 1;
+    matches[lane].push_back({lane * stretch_len + t,
+                             (hashes[lane] & masks.strict) == 0});
+  }
+}
+
+//
+// AVX2: 8 lanes
+//
+#define AVX2 __attribute__((target("avx2")))
+
+// the hashes of 8 lanes after one more byte each, in the low bytes of bytes
+AVX2 inline __m256i step_x8(__m256i hashes, __m256i bytes) {
+  bytes = _mm256_and_si256(bytes, _mm256_set1_epi32(0xff));
+  __m256i values = _mm256_i32gather_epi32((const int*)gear.data(), bytes, 4);
+  return _mm256_add_epi32(_mm256_slli_epi32(hashes, 1), values);
+}
+
+// scan 8 stretches of stretch_len bytes, a multiple of 4, back to back at
+// window, from the hashes right before them; matches are relative to window
+AVX2 void scan_x8(const unsigned char* window, size_t stretch_len,
+                  const uint32_t start_hashes[8], Masks masks,
+                  std::vector<Match> matches[8]) {
+  __m256i offsets = _mm256_mullo_epi32(
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+      _mm256_set1_epi32(stretch_len));
+  __m256i hashes = _mm256_loadu_si256((const __m256i*)start_hashes);
+  const __m256i loose = _mm256_set1_epi32(masks.loose);
+  const __m256i zero = _mm256_setzero_si256();
+  alignas(32) uint32_t lane_hashes[8];
+  for (size_t t = 0; t < stretch_len; t += 4) {
+    // the next 4 bytes of each lane, one byte per step
+    __m256i words = _mm256_i32gather_epi32((const int*)window, offsets, 1);
+    for (int i = 0; i < 4; i++) {
+      hashes = step_x8(hashes, words);
+      words = _mm256_srli_epi32(words, 8);
+      __m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(hashes, loose), zero);
+      unsigned int hits = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+      if (hits != 0) {
+        _mm256_store_si256((__m256i*)lane_hashes, hashes);
+        add_matches(hits, lane_hashes, stretch_len, t + i, masks, matches);
+      }
+    }
+    offsets = _mm256_add_epi32(offsets, _mm256_set1_epi32(4));
+  }
+}
+
+// The scanner spends its time on the gathers of the table lookups, and the
+// AVX-512 ones of 16 lanes are no faster per lane than the AVX2 ones of 8,
+// so the AVX2 scanner is used on AVX-512 CPUs as well.
+Kernel pick_kernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return KERNEL_AVX2;
+  }
+  return KERNEL_PORTABLE;
+}
+
+Kernel kernel() {
+  static const Kernel picked = pick_kernel();
+  return picked;
+}
+
+// every match of the len bytes at data, in order
+void find_matches(const unsigned char* data, size_t len, Masks masks,
+                  std::vector<Match>& matches) {
+  size_t num_of_lanes = kernel() == KERNEL_AVX2 ? 8 : 1;
+  std::vector<Match> lane_matches[8];
+  uint32_t hashes[8];
+  for (size_t offset = 0; offset < len; offset += kWindowLen) {
+    size_t window_len = std::min(kWindowLen, len - offset);
+    size_t stretch_len = window_len / num_of_lanes / 4 * 4;
+    size_t scanned = 0;
+    if (num_of_lanes > 1 && stretch_len >= kMinStretchLen) {
+      for (size_t lane = 0; lane < num_of_lanes; lane++) {
+        hashes[lane] = warm_up(data, offset + lane * stretch_len);
+      }
+      scan_x8(data + offset, stretch_len, hashes, masks, lane_matches);
+      // the stretches are in order, and so are the matches of each
+      for (size_t lane = 0; lane < num_of_lanes; lane++) {
+        for (const Match& match : lane_matches[lane]) {
+          matches.push_back({offset + match.pos, match.strict});
+        }
+        lane_matches[lane].clear();
+      }
+      scanned = num_of_lanes * stretch_len;
+    }
+    scan(data, offset + scanned, offset + window_len,
+         warm_up(data, offset + scanned), masks, matches);
+  }
+}
+
+} // namespace
+
+void fastcdc_chunk_ends(const unsigned char* data, size_t len,
+                        size_t min_size, size_t avg_size, size_t max_size,
+                        std::vector<size_t>& ends) {
+  max_size = std::max<size_t>(max_size, 1);
+  min_size = std::max<size_t>(std::min(min_size, max_size), 1);
+  avg_size = std::min(std::max(avg_size, min_size), max_size);
+  Masks masks = make_masks(avg_size);
+  std::vector<Match> matches;
+  find_matches(data, len, masks, matches);
+
+  // a chunk ends right after the first match at least min_size bytes in
+  // that matches the strict mask before avg_size bytes, or any match after
+  // that, or else at max_size bytes
+  size_t next = 0;
+  for (size_t start = 0; start < len;) {
+    size_t end = std::min(len, start + max_size);
+    while (next < matches.size() && matches[next].pos + 1 < start + min_size) {
+      next++;
+    }
+    for (size_t i = next; i < matches.size() && matches[i].pos + 1 < end;
+         i++) {
+      if (matches[i].strict || matches[i].pos + 1 - start >= avg_size) {
+        end = matches[i].pos + 1;
+        break;
+      }
+    }
+    ends.push_back(end);
+    start = end;
+  }
+}
+
+const char* fastcdc_scanner_kernel() {
+  return kernel() == KERNEL_AVX2 ? "avx2" : "portable";
+}
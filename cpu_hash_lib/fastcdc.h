@@ -0,0 +1,33 @@
+/*
+ * fastcdc.h Content-Defined Chunking on the CPU
+ *
+ * FastCDC cuts data where a Gear rolling hash matches a mask, so a chunk
+ * boundary depends only on the bytes right before it: an insertion or a
+ * deletion moves the boundaries around it and no others. The hash is 32 bits
+ * wide and shifts one bit per byte, so at each position it covers the last 32
+ * bytes, and the mask takes its top bits, which depend on the most bytes.
+ *
+ * A chunk is at least min_size bytes and at most max_size. Up to avg_size it
+ * is cut with a mask of two bits more than log2(avg_size), and after that with
+ * one of two bits fewer (normalized chunking), so the chunk sizes cluster
+ * around avg_size.
+ *
+ * The hash at a position does not depend on where the current chunk began,
+ * so the scanner hashes independent stretches of the data in 8 SIMD lanes
+ * with AVX2, where the CPU has it, and the cut points are picked among the
+ * matches it found afterwards.
+ */
+
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// append the end offset of each chunk of the len bytes at data to ends, in
+// order; the last one is len. min_size, avg_size and max_size are clamped so
+// that 1 <= min_size <= avg_size <= max_size.
+void fastcdc_chunk_ends(const unsigned char* data, size_t len,
+                        size_t min_size, size_t avg_size, size_t max_size,
+                        std::vector<size_t>& ends);
+
+// name of the scanner in use: "avx2" or "portable"
+const char* fastcdc_scanner_kernel();
@@ -0,0 +1,121 @@
+/*
+ * md5.h Inline MD5 on the CPU
+ *
+ * The MD5 compression function of RFC 1321, small enough to inline. md5()
+ * hashes a message of any length; md5_hash_pair() hashes the parent of two
+ * digests, which fits in a single block.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace md5_detail {
+
+inline constexpr uint32_t k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+  0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+  0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+inline constexpr int shifts[16] = {
+  7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+inline constexpr uint32_t h0[4] = {
+  0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+inline uint32_t rotl(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+// run the compression function on one block of 16 little-endian words
+inline void compress(uint32_t state[4], const uint32_t m[16]) {
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  // unrolled, so the round constants and message indices are immediates
+#pragma GCC unroll 64
+  for (int i = 0; i < 64; i++) {
+    uint32_t f;
+    int g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) % 16;
+    } else {
+      f = c ^ (b | ~d);
+      g = (7 * i) % 16;
+    }
+    f += a + k[i] + m[g];
+    a = d;
+    d = c;
+    c = b;
+    b += rotl(f, shifts[i / 16 * 4 + i % 4]);
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+inline void compress_bytes(uint32_t state[4], const unsigned char* block) {
+  uint32_t m[16];
+  memcpy(m, block, sizeof(m));  // MD5 words are little-endian, like x86
+  compress(state, m);
+}
+
+} // namespace md5_detail
+
+// hash data_len bytes of data into the 16-byte digest dout
+inline void md5(const unsigned char* data, size_t data_len,
+                unsigned char* dout) {
+  using namespace md5_detail;
+  uint32_t state[4];
+  memcpy(state, h0, sizeof(state));
+  size_t num_of_full_blocks = data_len / 64;
+  for (size_t i = 0; i < num_of_full_blocks; i++) {
+    compress_bytes(state, data + i * 64);
+  }
+  // the rest, 0x80, zeros and the length in bits, in one or two blocks
+  unsigned char tail[128] = {};
+  size_t rem = data_len % 64;
+  size_t tail_len = (rem + 9 > 64) ? 128 : 64;
+  memcpy(tail, data + num_of_full_blocks * 64, rem);
+  tail[rem] = 0x80;
+  uint64_t bit_len = (uint64_t)data_len * 8;
+  memcpy(tail + tail_len - 8, &bit_len, sizeof(bit_len));
+  for (size_t offset = 0; offset < tail_len; offset += 64) {
+    compress_bytes(state, tail + offset);
+  }
+  memcpy(dout, state, sizeof(state));
+}
+
+// hash the 32-byte concatenation lhs || rhs of two 16-byte digests into
+// dout; the digests and the padding fit in one block
+inline void md5_hash_pair(const unsigned char* lhs, const unsigned char* rhs,
+                          unsigned char* dout) {
+  using namespace md5_detail;
+  uint32_t state[4];
+  uint32_t m[16] = {};
+  memcpy(state, h0, sizeof(state));
+  memcpy(m, lhs, 16);
+  memcpy(m + 4, rhs, 16);
+  m[8] = 0x80;
+  m[14] = 32 * 8;
+  compress(state, m);
+  memcpy(dout, state, sizeof(state));
+}
@@ -0,0 +1,373 @@
+/*
+ * sha256.cpp Multi-buffer SHA256 Hashing on the CPU
+ *
+ * Each SIMD lane runs the SHA256 compression function of FIPS 180-4 on its
+ * own message, so the messages of one call must all have the same length.
+ */
+
+#include <immintrin.h>
+#include <openssl/sha.h>
+#include "sha256.h"
+
+namespace {
+
+using sha256_detail::k;
+using sha256_detail::h0;
+using sha256_detail::load_be32;
+using sha256_detail::store_be32;
+using sha256_detail::Schedule;
+
+enum Kernel {
+  KERNEL_OPENSSL,
+  KERNEL_AVX2,
+  KERNEL_AVX512
+};
+
+// write the padded end of a message into tail: the bytes after its last full
+// 64-byte block, 0x80, zeros and the length in bits. Returns the number of
+// 64-byte blocks in tail (1 or 2).
+size_t make_tail(const unsigned char* msg, size_t msg_len,
+                 unsigned char tail[128]) {
+  size_t rem = msg_len % 64;
+  size_t num_of_tail_blocks = (rem + 9 > 64) ? 2 : 1;
+  memset(tail, 0, 128);
+  memcpy(tail, msg + msg_len - rem, rem);
+  tail[rem] = 0x80;
+  uint64_t bit_len = (uint64_t)msg_len * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[num_of_tail_blocks * 64 - 1 - i] = (unsigned char)(bit_len >> (i * 8));
+  }
+  return num_of_tail_blocks;
+}
+
+//
+// AVX2: 8 lanes
+//
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256i rotr_x8(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+AVX2 inline __m256i xor3_x8(__m256i a, __m256i b, __m256i c) {
+  return _mm256_xor_si256(_mm256_xor_si256(a, b), c);
+}
+
+// one round on the working variables s, a to h, of 8 lanes
+AVX2 inline void round_x8(__m256i s[8], __m256i kw) {
+  __m256i a = s[0], b = s[1], c = s[2], e = s[4], f = s[5], g = s[6];
+  __m256i ep1 = xor3_x8(rotr_x8(e, 6), rotr_x8(e, 11), rotr_x8(e, 25));
+  __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                _mm256_andnot_si256(e, g));
+  __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(s[7], ep1),
+                                _mm256_add_epi32(ch, kw));
+  __m256i ep0 = xor3_x8(rotr_x8(a, 2), rotr_x8(a, 13), rotr_x8(a, 22));
+  __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                                _mm256_and_si256(c, _mm256_or_si256(a, b)));
+  s[7] = g;
+  s[6] = f;
+  s[5] = e;
+  s[4] = _mm256_add_epi32(s[3], t1);
+  s[3] = c;
+  s[2] = b;
+  s[1] = a;
+  s[0] = _mm256_add_epi32(t1, _mm256_add_epi32(ep0, maj));
+}
+
+// compress one block per lane; w holds the first 16 words of each block and
+// is overwritten by the message schedule
+AVX2 inline void compress_x8(__m256i state[8], __m256i w[16]) {
+  __m256i s[8];
+  for (int i = 0; i < 8; i++) {
+    s[i] = state[i];
+  }
+  for (int t = 0; t < 64; t++) {
+    if (t >= 16) {
+      __m256i w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+      __m256i s0 = xor3_x8(rotr_x8(w15, 7), rotr_x8(w15, 18),
+                           _mm256_srli_epi32(w15, 3));
+      __m256i s1 = xor3_x8(rotr_x8(w2, 17), rotr_x8(w2, 19),
+                           _mm256_srli_epi32(w2, 10));
+      w[t & 15] = _mm256_add_epi32(
+          _mm256_add_epi32(w[t & 15], s0),
+          _mm256_add_epi32(w[(t - 7) & 15], s1));
+    }
+    round_x8(s, _mm256_add_epi32(_mm256_set1_epi32(k[t]), w[t & 15]));
+  }
+  for (int i = 0; i < 8; i++) {
+    state[i] = _mm256_add_epi32(state[i], s[i]);
+  }
+}
+
+// compress the same block in every lane, given its schedule
+AVX2 inline void compress_x8(__m256i state[8], const Schedule& schedule) {
+  __m256i s[8];
+  for (int i = 0; i < 8; i++) {
+    s[i] = state[i];
+  }
+  for (int t = 0; t < 64; t++) {
+    round_x8(s, _mm256_set1_epi32(schedule.kw[t]));
+  }
+  for (int i = 0; i < 8; i++) {
+    state[i] = _mm256_add_epi32(state[i], s[i]);
+  }
+}
+
+AVX2 void sha256_x8(const unsigned char* const msgs[8], size_t msg_len,
+                    unsigned char* const digests[8],
+                    const Schedule* padding) {
+  unsigned char tails[8][128];
+  size_t num_of_tail_blocks = 0;
+  if (padding == nullptr) {
+    for (int lane = 0; lane < 8; lane++) {
+      num_of_tail_blocks = make_tail(msgs[lane], msg_len, tails[lane]);
+    }
+  }
+  size_t num_of_full_blocks = msg_len / 64;
+
+  __m256i state[8];
+  for (int i = 0; i < 8; i++) {
+    state[i] = _mm256_set1_epi32(h0[i]);
+  }
+  for (size_t b = 0; b < num_of_full_blocks + num_of_tail_blocks; b++) {
+    const unsigned char* blocks[8];
+    for (int lane = 0; lane < 8; lane++) {
+      blocks[lane] = (b < num_of_full_blocks)
+          ? msgs[lane] + b * 64
+          : tails[lane] + (b - num_of_full_blocks) * 64;
+    }
+    __m256i w[16];
+    for (int t = 0; t < 16; t++) {
+      w[t] = _mm256_setr_epi32(
+          load_be32(blocks[0] + t * 4), load_be32(blocks[1] + t * 4),
+          load_be32(blocks[2] + t * 4), load_be32(blocks[3] + t * 4),
+          load_be32(blocks[4] + t * 4), load_be32(blocks[5] + t * 4),
+          load_be32(blocks[6] + t * 4), load_be32(blocks[7] + t * 4));
+    }
+    compress_x8(state, w);
+  }
+  if (padding != nullptr) {
+    compress_x8(state, *padding);
+  }
+
+  alignas(32) uint32_t words[8][8];
+  for (int i = 0; i < 8; i++) {
+    _mm256_store_si256((__m256i*)words[i], state[i]);
+  }
+  for (int lane = 0; lane < 8; lane++) {
+    for (int i = 0; i < 8; i++) {
+      store_be32(digests[lane] + i * 4, words[i][lane]);
+    }
+  }
+}
+
+//
+// AVX-512: 16 lanes, with native rotates and ternary logic
+//
+#define AVX512 __attribute__((target("avx512f")))
+
+// the maskz forms with a full mask are the plain rotate and shift; unlike
+// those they leave no undefined register for GCC to warn about. The count is
+// an immediate, so it is a template argument rather than left to inlining
+template <int N>
+AVX512 inline __m512i rotr_x16(__m512i x) {
+  return _mm512_maskz_ror_epi32(0xffff, x, N);
+}
+
+template <int N>
+AVX512 inline __m512i shr_x16(__m512i x) {
+  return _mm512_maskz_srli_epi32(0xffff, x, N);
+}
+
+AVX512 inline __m512i xor3_x16(__m512i a, __m512i b, __m512i c) {
+  return _mm512_ternarylogic_epi32(a, b, c, 0x96);
+}
+
+// one round on the working variables s, a to h, of 16 lanes
+AVX512 inline void round_x16(__m512i s[8], __m512i kw) {
+  __m512i a = s[0], b = s[1], c = s[2], e = s[4], f = s[5], g = s[6];
+  __m512i ep1 = xor3_x16(rotr_x16<6>(e), rotr_x16<11>(e), rotr_x16<25>(e));
+  __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xca);
+  __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(s[7], ep1),
+                                _mm512_add_epi32(ch, kw));
+  __m512i ep0 = xor3_x16(rotr_x16<2>(a), rotr_x16<13>(a), rotr_x16<22>(a));
+  __m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xe8);
+  s[7] = g;
+  s[6] = f;
+  s[5] = e;
+  s[4] = _mm512_add_epi32(s[3], t1);
+  s[3] = c;
+  s[2] = b;
+  s[1] = a;
+  s[0] = _mm512_add_epi32(t1, _mm512_add_epi32(ep0, maj));
+}
+
+// compress one block per lane; w holds the first 16 words of each block and
+// is overwritten by the message schedule
+AVX512 inline void compress_x16(__m512i state[8], __m512i w[16]) {
+  __m512i s[8];
+  for (int i = 0; i < 8; i++) {
+    s[i] = state[i];
+  }
+  for (int t = 0; t < 64; t++) {
+    if (t >= 16) {
+      __m512i w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+      __m512i s0 = xor3_x16(rotr_x16<7>(w15),
+                            rotr_x16<18>(w15),
+                            shr_x16<3>(w15));
+      __m512i s1 = xor3_x16(rotr_x16<17>(w2),
+                            rotr_x16<19>(w2),
+                            shr_x16<10>(w2));
+      w[t & 15] = _mm512_add_epi32(
+          _mm512_add_epi32(w[t & 15], s0),
+          _mm512_add_epi32(w[(t - 7) & 15], s1));
+    }
+    round_x16(s, _mm512_add_epi32(_mm512_set1_epi32(k[t]), w[t & 15]));
+  }
+  for (int i = 0; i < 8; i++) {
+    state[i] = _mm512_add_epi32(state[i], s[i]);
+  }
+}
+
+// compress the same block in every lane, given its schedule
+AVX512 inline void compress_x16(__m512i state[8], const Schedule& schedule) {
+  __m512i s[8];
+  for (int i = 0; i < 8; i++) {
+    s[i] = state[i];
+  }
+  for (int t = 0; t < 64; t++) {
+    round_x16(s, _mm512_set1_epi32(schedule.kw[t]));
+  }
+  for (int i = 0; i < 8; i++) {
+    state[i] = _mm512_add_epi32(state[i], s[i]);
+  }
+}
+
+AVX512 void sha256_x16(const unsigned char* const msgs[16], size_t msg_len,
+                       unsigned char* const digests[16],
+                       const Schedule* padding) {
+  unsigned char tails[16][128];
+  size_t num_of_tail_blocks = 0;
+  if (padding == nullptr) {
+    for (int lane = 0; lane < 16; lane++) {
+      num_of_tail_blocks = make_tail(msgs[lane], msg_len, tails[lane]);
+    }
+  }
+  size_t num_of_full_blocks = msg_len / 64;
+
+  __m512i state[8];
+  for (int i = 0; i < 8; i++) {
+    state[i] = _mm512_set1_epi32(h0[i]);
+  }
+  for (size_t b = 0; b < num_of_full_blocks + num_of_tail_blocks; b++) {
+    const unsigned char* blocks[16];
+    for (int lane = 0; lane < 16; lane++) {
+      blocks[lane] = (b < num_of_full_blocks)
+          ? msgs[lane] + b * 64
+          : tails[lane] + (b - num_of_full_blocks) * 64;
+    }
+    __m512i w[16];
+    for (int t = 0; t < 16; t++) {
+      alignas(64) uint32_t words[16];
+      for (int lane = 0; lane < 16; lane++) {
+        words[lane] = load_be32(blocks[lane] + t * 4);
+      }
+      w[t] = _mm512_load_si512(words);
+    }
+    compress_x16(state, w);
+  }
+  if (padding != nullptr) {
+    compress_x16(state, *padding);
+  }
+
+  alignas(64) uint32_t words[8][16];
+  for (int i = 0; i < 8; i++) {
+    _mm512_store_si512(words[i], state[i]);
+  }
+  for (int lane = 0; lane < 16; lane++) {
+    for (int i = 0; i < 8; i++) {
+      store_be32(digests[lane] + i * 4, words[i][lane]);
+    }
+  }
+}
+
+// the widest kernel the CPU runs. Even next to SHA-NI the lanes win on the
+// short messages of a tree (64-byte pairs, 1 KiB blocks), since every
+// OpenSSL call pays its own setup and padding.
+Kernel pick_kernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return KERNEL_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return KERNEL_AVX2;
+  }
+  return KERNEL_OPENSSL;
+}
+
+Kernel kernel() {
+  static const Kernel picked = pick_kernel();
+  return picked;
+}
+
+} // namespace
+
+void sha256_multi_buffer(const unsigned char* din, size_t msg_len,
+                         unsigned char* dout, size_t num_of_msgs) {
+  // a message of whole blocks ends with a padding block that is the same in
+  // every lane, so its schedule is computed once here instead of per lane;
+  // the one of the parents of a tree is a constant
+  Schedule schedule;
+  const Schedule* padding = nullptr;
+  if (msg_len == 64) {
+    padding = &sha256_detail::pair_padding_schedule;
+  } else if (msg_len % 64 == 0) {
+    schedule = sha256_detail::padding_schedule(msg_len);
+    padding = &schedule;
+  }
+  size_t i = 0;
+  if (kernel() == KERNEL_AVX512) {
+    for (; i + 16 <= num_of_msgs; i += 16) {
+      const unsigned char* msgs[16];
+      unsigned char* digests[16];
+      for (int lane = 0; lane < 16; lane++) {
+        msgs[lane] = din + (i + lane) * msg_len;
+        digests[lane] = dout + (i + lane) * SHA256_DIGEST_LENGTH;
+      }
+      sha256_x16(msgs, msg_len, digests, padding);
+    }
+  }
+  if (kernel() == KERNEL_AVX512 || kernel() == KERNEL_AVX2) {
+    for (; i + 8 <= num_of_msgs; i += 8) {
+      const unsigned char* msgs[8];
+      unsigned char* digests[8];
+      for (int lane = 0; lane < 8; lane++) {
+        msgs[lane] = din + (i + lane) * msg_len;
+        digests[lane] = dout + (i + lane) * SHA256_DIGEST_LENGTH;
+      }
+      sha256_x8(msgs, msg_len, digests, padding);
+    }
+  }
+  // the rest of the parents inline; OpenSSL takes the other messages, and
+  // everything on the OpenSSL kernel
+  if (msg_len == 64 && kernel() != KERNEL_OPENSSL) {
+    for (; i < num_of_msgs; i++) {
+      sha256_hash_pair(din + i * 64, din + i * 64 + 32,
+                       dout + i * SHA256_DIGEST_LENGTH);
+    }
+  }
+  for (; i < num_of_msgs; i++) {
+    SHA256(din + i * msg_len, msg_len, dout + i * SHA256_DIGEST_LENGTH);
+  }
+}
+
+const char* sha256_multi_buffer_kernel() {
+  switch (kernel()) {
+    case KERNEL_AVX512:
+      return "avx512";
+    case KERNEL_AVX2:
+      return "avx2";
+    default:
+      return "openssl";
+  }
+}
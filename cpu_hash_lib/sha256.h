@@ -0,0 +1,167 @@
+/*
+ * sha256.h Multi-buffer SHA256 Hashing on the CPU
+ *
+ * Hashes many independent messages of the same length at once, one message
+ * per SIMD lane: 16 lanes with AVX-512, 8 lanes with AVX2. The kernel is
+ * picked at runtime; CPUs without AVX2 hash every message through OpenSSL,
+ * which uses the SHA extensions (SHA-NI) where they are available.
+ *
+ * sha256_hash_pair() hashes the parent of two digests inline, for callers
+ * that know at compile time they hash exactly 64 bytes. A 64-byte message is
+ * one block of data and one block of padding that never changes, so the
+ * schedule of the padding block is computed once, at compile time, and its
+ * compression only runs the rounds.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace sha256_detail {
+
+inline constexpr uint32_t k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline constexpr uint32_t h0[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+inline uint32_t load_be32(const unsigned char* p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return __builtin_bswap32(word);
+}
+
+inline void store_be32(unsigned char* p, uint32_t word) {
+  word = __builtin_bswap32(word);
+  memcpy(p, &word, sizeof(word));
+}
+
+constexpr uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+// k[t] + w[t] for every round of one block
+struct Schedule {
+  uint32_t kw[64];
+};
+
+// the schedule of the padding block that ends a message of msg_len bytes,
+// msg_len being a multiple of 64: 0x80, zeros and the length in bits
+constexpr Schedule padding_schedule(uint64_t msg_len) {
+  uint32_t w[64] = {0x80000000};
+  w[14] = (uint32_t)(msg_len * 8 >> 32);
+  w[15] = (uint32_t)(msg_len * 8);
+  for (int t = 16; t < 64; t++) {
+    uint32_t w15 = w[t - 15];
+    uint32_t w2 = w[t - 2];
+    w[t] = w[t - 16] + (rotr(w15, 7) ^ rotr(w15, 18) ^ (w15 >> 3)) +
+           w[t - 7] + (rotr(w2, 17) ^ rotr(w2, 19) ^ (w2 >> 10));
+  }
+  Schedule schedule = {};
+  for (int t = 0; t < 64; t++) {
+    schedule.kw[t] = k[t] + w[t];
+  }
+  return schedule;
+}
+
+// the padding block of the parent of two digests
+inline constexpr Schedule pair_padding_schedule = padding_schedule(64);
+
+// one round of the compression function on the working variables s, a to h,
+// with kw = k[t] + w[t]
+inline void round(uint32_t s[8], uint32_t kw) {
+  uint32_t a = s[0], b = s[1], c = s[2], e = s[4], f = s[5], g = s[6];
+  uint32_t t1 = s[7] + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                ((e & f) ^ (~e & g)) + kw;
+  uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                ((a & b) ^ (a & c) ^ (b & c));
+  s[7] = g;
+  s[6] = f;
+  s[5] = e;
+  s[4] = s[3] + t1;
+  s[3] = c;
+  s[2] = b;
+  s[1] = a;
+  s[0] = t1 + t2;
+}
+
+// run the compression function on one block of 16 big-endian words, which
+// are overwritten by the message schedule
+inline void compress(uint32_t state[8], uint32_t w[16]) {
+  uint32_t s[8];
+  memcpy(s, state, sizeof(s));
+  // unrolled, so the round constants and message indices are immediates
+#pragma GCC unroll 64
+  for (int i = 0; i < 64; i++) {
+    if (i >= 16) {
+      uint32_t w15 = w[(i - 15) & 15];
+      uint32_t w2 = w[(i - 2) & 15];
+      w[i & 15] += (rotr(w2, 17) ^ rotr(w2, 19) ^ (w2 >> 10)) +
+                   w[(i - 7) & 15] +
+                   (rotr(w15, 7) ^ rotr(w15, 18) ^ (w15 >> 3));
+    }
+    round(s, k[i] + w[i & 15]);
+  }
+  for (int i = 0; i < 8; i++) {
+    state[i] += s[i];
+  }
+}
+
+// run the compression function on a block whose schedule is known already
+inline void compress(uint32_t state[8], const Schedule& schedule) {
+  uint32_t s[8];
+  memcpy(s, state, sizeof(s));
+#pragma GCC unroll 64
+  for (int i = 0; i < 64; i++) {
+    round(s, schedule.kw[i]);
+  }
+  for (int i = 0; i < 8; i++) {
+    state[i] += s[i];
+  }
+}
+
+} // namespace sha256_detail
+
+// hash the 64-byte concatenation lhs || rhs of two 32-byte digests into
+// dout. The second block is always the padding of a 64-byte message, so
+// there is no length handling, the padding block only runs its rounds, and
+// the whole hash inlines into the caller.
+inline void sha256_hash_pair(const unsigned char* lhs, const unsigned char* rhs,
+                             unsigned char* dout) {
+  using namespace sha256_detail;
+  uint32_t state[8];
+  uint32_t w[16];
+  memcpy(state, h0, sizeof(state));
+  for (int i = 0; i < 8; i++) {
+    w[i] = load_be32(lhs + i * 4);
+    w[i + 8] = load_be32(rhs + i * 4);
+  }
+  compress(state, w);
+  compress(state, pair_padding_schedule);
+  for (int i = 0; i < 8; i++) {
+    store_be32(dout + i * 4, state[i]);
+  }
+}
+
+// hash num_of_msgs messages of msg_len bytes each, laid out back to back in
+// din, into num_of_msgs 32-byte digests laid out back to back in dout
+void sha256_multi_buffer(const unsigned char* din, size_t msg_len,
+                         unsigned char* dout, size_t num_of_msgs);
+
+// name of the kernel sha256_multi_buffer() runs on this CPU:
+// "avx512", "avx2" or "openssl"
+const char* sha256_multi_buffer_kernel();
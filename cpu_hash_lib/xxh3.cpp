@@ -0,0 +1,374 @@
+/*
+ * xxh3.cpp XXH3 128-bit Hashing on the CPU
+ *
+ * Follows the reference implementation of xxHash 0.8 for seed 0. Inputs of
+ * up to 240 bytes are mixed directly; longer ones, such as tree blocks of
+ * 1 KiB and more, go through the 8 accumulators of 64 bits, which are
+ * updated with AVX2 where the CPU has it.
+ */
+
+#include <immintrin.h>
+#include <cstdint>
+#include <cstring>
+#include "xxh3.h"
+
+namespace {
+
+const uint32_t kPrime32_1 = 0x9E3779B1U;
+const uint32_t kPrime32_2 = 0x85EBCA77U;
+const uint32_t kPrime32_3 = 0xC2B2AE3DU;
+const uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+const uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+const size_t kStripeLen = 64;
+const size_t kSecretConsumeRate = 8;
+const size_t kSecretSize = 192;
+const size_t kSecretSizeMin = 136;
+const size_t kSecretMergeAccsStart = 11;
+const size_t kSecretLastAccStart = 7;
+const size_t kMidSizeMax = 240;
+
+alignas(64) const unsigned char secret[kSecretSize] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+  0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+  0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+  0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+  0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+  0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+  0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+  0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+  0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+  0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+  0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+  0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+  0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+enum Kernel {
+  KERNEL_SCALAR,
+  KERNEL_AVX2
+};
+
+struct Hash128 {
+  uint64_t low;
+  uint64_t high;
+};
+
+inline uint32_t read32(const unsigned char* p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+inline uint64_t read64(const unsigned char* p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+inline void write_be64(unsigned char* p, uint64_t word) {
+  word = __builtin_bswap64(word);
+  memcpy(p, &word, sizeof(word));
+}
+
+inline uint64_t rotl64(uint64_t x, int n) {
+  return (x << n) | (x >> (64 - n));
+}
+
+inline Hash128 mul64_to128(uint64_t lhs, uint64_t rhs) {
+  unsigned __int128 product = (unsigned __int128)lhs * rhs;
+  return {(uint64_t)product, (uint64_t)(product >> 64)};
+}
+
+inline uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs) {
+  Hash128 product = mul64_to128(lhs, rhs);
+  return product.low ^ product.high;
+}
+
+inline uint64_t xorshift64(uint64_t x, int shift) {
+  return x ^ (x >> shift);
+}
+
+// the final mix of XXH64
+inline uint64_t xxh64_avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= kPrime64_2;
+  h ^= h >> 29;
+  h *= kPrime64_3;
+  return h ^ (h >> 32);
+}
+
+inline uint64_t avalanche(uint64_t h) {
+  h = xorshift64(h, 37);
+  h *= 0x165667919E3779F9ULL;
+  return xorshift64(h, 32);
+}
+
+//
+// Short inputs: 0 to 240 bytes
+//
+Hash128 hash_1to3(const unsigned char* input, size_t len) {
+  uint32_t c1 = input[0];
+  uint32_t c2 = input[len >> 1];
+  uint32_t c3 = input[len - 1];
+  uint32_t combined_low = (c1 << 16) | (c2 << 24) | c3 | ((uint32_t)len << 8);
+  uint32_t combined_high = __builtin_bswap32(combined_low);
+  combined_high = (combined_high << 13) | (combined_high >> 19);
+  uint64_t flip_low = (uint64_t)(read32(secret) ^ read32(secret + 4));
+  uint64_t flip_high = (uint64_t)(read32(secret + 8) ^ read32(secret + 12));
+  return {xxh64_avalanche(combined_low ^ flip_low),
+          xxh64_avalanche(combined_high ^ flip_high)};
+}
+
+Hash128 hash_4to8(const unsigned char* input, size_t len) {
+  uint64_t input_low = read32(input);
+  uint64_t input_high = read32(input + len - 4);
+  uint64_t input_64 = input_low + (input_high << 32);
+  uint64_t flip = read64(secret + 16) ^ read64(secret + 24);
+  Hash128 m = mul64_to128(input_64 ^ flip, kPrime64_1 + (len << 2));
+  m.high += m.low << 1;
+  m.low ^= m.high >> 3;
+  m.low = xorshift64(m.low, 35) * 0x9FB21C651E98DF25ULL;
+  m.low = xorshift64(m.low, 28);
+  m.high = avalanche(m.high);
+  return m;
+}
+
+Hash128 hash_9to16(const unsigned char* input, size_t len) {
+  uint64_t flip_low = read64(secret + 32) ^ read64(secret + 40);
+  uint64_t flip_high = read64(secret + 48) ^ read64(secret + 56);
+  uint64_t input_low = read64(input);
+  uint64_t input_high = read64(input + len - 8);
+  Hash128 m = mul64_to128(input_low ^ input_high ^ flip_low, kPrime64_1);
+  m.low += (uint64_t)(len - 1) << 54;
+  input_high ^= flip_high;
+  m.high += input_high + (uint64_t)(uint32_t)input_high * (kPrime32_2 - 1);
+  m.low ^= __builtin_bswap64(m.high);
+  Hash128 h = mul64_to128(m.low, kPrime64_2);
+  h.high += m.high * kPrime64_2;
+  return {avalanche(h.low), avalanche(h.high)};
+}
+
+Hash128 hash_0to16(const unsigned char* input, size_t len) {
+  if (len > 8) {
+    return hash_9to16(input, len);
+  }
+  if (len >= 4) {
+    return hash_4to8(input, len);
+  }
+  if (len > 0) {
+    return hash_1to3(input, len);
+  }
+  return {xxh64_avalanche(read64(secret + 64) ^ read64(secret + 72)),
+          xxh64_avalanche(read64(secret + 80) ^ read64(secret + 88))};
+}
+
+inline uint64_t mix16(const unsigned char* input, const unsigned char* key) {
+  return mul128_fold64(read64(input) ^ read64(key),
+                       read64(input + 8) ^ read64(key + 8));
+}
+
+inline void mix32(Hash128& acc, const unsigned char* input_1,
+                  const unsigned char* input_2, const unsigned char* key) {
+  acc.low += mix16(input_1, key);
+  acc.low ^= read64(input_2) + read64(input_2 + 8);
+  acc.high += mix16(input_2, key + 16);
+  acc.high ^= read64(input_1) + read64(input_1 + 8);
+}
+
+Hash128 finish_mid(Hash128 acc, size_t len) {
+  uint64_t low = acc.low + acc.high;
+  uint64_t high = acc.low * kPrime64_1 + acc.high * kPrime64_4 +
+                  (uint64_t)len * kPrime64_2;
+  return {avalanche(low), 0 - avalanche(high)};
+}
+
+Hash128 hash_17to128(const unsigned char* input, size_t len) {
+  Hash128 acc = {len * kPrime64_1, 0};
+  if (len > 32) {
+    if (len > 64) {
+      if (len > 96) {
+        mix32(acc, input + 48, input + len - 64, secret + 96);
+      }
+      mix32(acc, input + 32, input + len - 48, secret + 64);
+    }
+    mix32(acc, input + 16, input + len - 32, secret + 32);
+  }
+  mix32(acc, input, input + len - 16, secret);
+  return finish_mid(acc, len);
+}
+
+Hash128 hash_129to240(const unsigned char* input, size_t len) {
+  const size_t kStartOffset = 3;
+  const size_t kLastOffset = 17;
+  size_t num_of_rounds = len / 32;
+  Hash128 acc = {len * kPrime64_1, 0};
+  for (size_t i = 0; i < 4; i++) {
+    mix32(acc, input + 32 * i, input + 32 * i + 16, secret + 32 * i);
+  }
+  acc.low = avalanche(acc.low);
+  acc.high = avalanche(acc.high);
+  for (size_t i = 4; i < num_of_rounds; i++) {
+    mix32(acc, input + 32 * i, input + 32 * i + 16,
+          secret + kStartOffset + 32 * (i - 4));
+  }
+  mix32(acc, input + len - 16, input + len - 32,
+        secret + kSecretSizeMin - kLastOffset - 16);
+  return finish_mid(acc, len);
+}
+
+//
+// Long inputs: stripes of 64 bytes into 8 accumulators
+//
+
+// accumulate num_of_stripes stripes of input, the i-th with the secret at
+// key + i * 8
+void accumulate_scalar(uint64_t acc[8], const unsigned char* input,
+                       const unsigned char* key, size_t num_of_stripes) {
+  for (size_t s = 0; s < num_of_stripes; s++) {
+    const unsigned char* stripe = input + s * kStripeLen;
+    const unsigned char* stripe_key = key + s * kSecretConsumeRate;
+    for (int i = 0; i < 8; i++) {
+      uint64_t data = read64(stripe + i * 8);
+      uint64_t data_key = data ^ read64(stripe_key + i * 8);
+      acc[i ^ 1] += data;
+      acc[i] += (uint64_t)(uint32_t)data_key * (data_key >> 32);
+    }
+  }
+}
+
+void scramble_scalar(uint64_t acc[8], const unsigned char* key) {
+  for (int i = 0; i < 8; i++) {
+    acc[i] = (xorshift64(acc[i], 47) ^ read64(key + i * 8)) * kPrime32_1;
+  }
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 void accumulate_avx2(uint64_t acc[8], const unsigned char* input,
+                          const unsigned char* key, size_t num_of_stripes) {
+  __m256i a[2];
+  for (int i = 0; i < 2; i++) {
+    a[i] = _mm256_loadu_si256((const __m256i*)acc + i);
+  }
+  for (size_t s = 0; s < num_of_stripes; s++) {
+    const unsigned char* stripe = input + s * kStripeLen;
+    const unsigned char* stripe_key = key + s * kSecretConsumeRate;
+    for (int i = 0; i < 2; i++) {
+      __m256i data = _mm256_loadu_si256((const __m256i*)stripe + i);
+      __m256i data_key = _mm256_xor_si256(
+          data, _mm256_loadu_si256((const __m256i*)stripe_key + i));
+      // the low 32 bits of each lane times its high 32 bits
+      __m256i product = _mm256_mul_epu32(data_key,
+                                         _mm256_srli_epi64(data_key, 32));
+      // data goes to the other accumulator of its pair
+      __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+      a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, swapped));
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    _mm256_storeu_si256((__m256i*)acc + i, a[i]);
+  }
+}
+
+AVX2 void scramble_avx2(uint64_t acc[8], const unsigned char* key) {
+  const __m256i prime = _mm256_set1_epi32(kPrime32_1);
+  for (int i = 0; i < 2; i++) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)acc + i);
+    a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+    a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)key + i));
+    // a 64-bit product from two 32-bit ones
+    __m256i low = _mm256_mul_epu32(a, prime);
+    __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+    a = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    _mm256_storeu_si256((__m256i*)acc + i, a);
+  }
+}
+
+Kernel pick_kernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return KERNEL_AVX2;
+  }
+  return KERNEL_SCALAR;
+}
+
+Kernel kernel() {
+  static const Kernel picked = pick_kernel();
+  return picked;
+}
+
+void accumulate(uint64_t acc[8], const unsigned char* input,
+                const unsigned char* key, size_t num_of_stripes) {
+  if (kernel() == KERNEL_AVX2) {
+    accumulate_avx2(acc, input, key, num_of_stripes);
+  } else {
+    accumulate_scalar(acc, input, key, num_of_stripes);
+  }
+}
+
+void scramble(uint64_t acc[8], const unsigned char* key) {
+  if (kernel() == KERNEL_AVX2) {
+    scramble_avx2(acc, key);
+  } else {
+    scramble_scalar(acc, key);
+  }
+}
+
+uint64_t merge_accs(const uint64_t acc[8], const unsigned char* key,
+                    uint64_t start) {
+  uint64_t result = start;
+  for (int i = 0; i < 4; i++) {
+    result += mul128_fold64(acc[2 * i] ^ read64(key + 16 * i),
+                            acc[2 * i + 1] ^ read64(key + 16 * i + 8));
+  }
+  return avalanche(result);
+}
+
+Hash128 hash_long(const unsigned char* input, size_t len) {
+  uint64_t acc[8] = {
+    kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3,
+    kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1
+  };
+  // a block is as many stripes as the secret has 8-byte steps
+  const size_t stripes_per_block = (kSecretSize - kStripeLen) /
+                                   kSecretConsumeRate;
+  const size_t block_len = kStripeLen * stripes_per_block;
+  size_t num_of_blocks = (len - 1) / block_len;
+  for (size_t b = 0; b < num_of_blocks; b++) {
+    accumulate(acc, input + b * block_len, secret, stripes_per_block);
+    scramble(acc, secret + kSecretSize - kStripeLen);
+  }
+  // the stripes of the last block, and the last stripe of the input again,
+  // with a secret of its own
+  size_t num_of_stripes = ((len - 1) - block_len * num_of_blocks) / kStripeLen;
+  accumulate(acc, input + num_of_blocks * block_len, secret, num_of_stripes);
+  accumulate(acc, input + len - kStripeLen,
+             secret + kSecretSize - kStripeLen - kSecretLastAccStart, 1);
+  return {merge_accs(acc, secret + kSecretMergeAccsStart, len * kPrime64_1),
+          merge_accs(acc, secret + kSecretSize - 64 - kSecretMergeAccsStart,
+                     ~(len * kPrime64_2))};
+}
+
+} // namespace
+
+void xxh3_128(const unsigned char* data, size_t msg_len, unsigned char* hash) {
+  Hash128 h;
+  if (msg_len <= 16) {
+    h = hash_0to16(data, msg_len);
+  } else if (msg_len <= 128) {
+    h = hash_17to128(data, msg_len);
+  } else if (msg_len <= kMidSizeMax) {
+    h = hash_129to240(data, msg_len);
+  } else {
+    h = hash_long(data, msg_len);
+  }
+  write_be64(hash, h.high);
+  write_be64(hash + 8, h.low);
+}
@@ -0,0 +1,17 @@
+/*
+ * xxh3.h XXH3 128-bit Hashing on the CPU
+ *
+ * The 128-bit XXH3 hash of xxHash 0.8 with seed 0 and the default secret.
+ * It is not a cryptographic hash: it catches corruption, not tampering, so
+ * a tree built with it only suits data nobody has a reason to forge.
+ *
+ * The digest is the canonical form of the hash, the high 64 bits first,
+ * both halves big-endian, as XXH128_canonicalFromHash() and the hex
+ * digests of the xxhash tools write it.
+ */
+
+#pragma once
+#include <cstddef>
+
+// hash msg_len bytes at data into 16 bytes at hash
+void xxh3_128(const unsigned char* data, size_t msg_len, unsigned char* hash);
@@ -2,15 +2,27 @@
 #define MERKLE_TREE_HPP
 
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
 #include <cmath>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <queue>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include "cuda_hashmap_lib/src/linearprobing.h"
+#include "utils/mapped_file.hpp"
 
+// the block size of trees that are not given one; each tree keeps its own
+// from when it is made
 extern int BLOCK_SIZE;
 
 // Indicate the node to be the LEFT or RIGHT child of its parent
@@ -27,19 +39,45 @@ enum LeftOrRightSib {
 #define ACCEL_LINK        8
 #define ACCEL_HASHMAP     16
 
+// CPU multithreading bit masks
+#define ACCEL_CPU_CREATION   32
+#define ACCEL_CPU_REDUCTION  64
+
+// Ids of the hash algorithms, stored in saved trees; never renumber them
+enum HasherId {
+  HASHER_UNKNOWN,
+  HASHER_SHA_256,
+  HASHER_MD_5,
+  HASHER_BLAKE_3,
+  HASHER_XXH3_128
+};
+
 // Hash algorithms
+// NOTE: a Hasher is shared by all worker threads of a multithreaded build,
+// so get_hash() must not keep any per-call state in the object.
 class Hasher {
  protected:
   unsigned int digest_size;
+  HasherId hasher_id = HASHER_UNKNOWN;
 
  public:
   virtual void get_hash(unsigned char *data, int data_len,
                         unsigned char *hash) = 0;
+  // hash num_of_blocks blocks of block_size bytes laid out back to back in
+  // din; one at a time unless a Hasher has a faster way
   virtual void get_hash(unsigned char* din, int block_size,
-                        unsigned char* dout, int num_of_blocks) {}
+                        unsigned char* dout, int num_of_blocks) {
+    for (int i = 0; i < num_of_blocks; i++) {
+      get_hash(din + (size_t)i * block_size, block_size,
+               dout + (size_t)i * digest_size);
+    }
+  }
   unsigned int hash_length() const {
     return digest_size;
   }
+  HasherId id() const {
+    return hasher_id;
+  }
   virtual ~Hasher() {}
 };
 
@@ -50,6 +88,11 @@ class SHA_256 : public Hasher {
   void get_hash(unsigned char* data,
                 int data_len,
                 unsigned char* hash) override;
+  // multi-buffer SIMD hashing, see cpu_hash_lib/sha256.h
+  void get_hash(unsigned char* din,
+                int block_size,
+                unsigned char* dout,
+                int num_of_blocks) override;
 };
 
 class MD_5 : public Hasher {
@@ -61,6 +104,32 @@ class MD_5 : public Hasher {
                 unsigned char* hash) override;
 };
 
+// BLAKE3: cryptographic like SHA_256, and several times faster on the CPU
+class BLAKE_3 : public Hasher {
+ public:
+  using Hasher::get_hash;
+  BLAKE_3();
+  void get_hash(unsigned char* data,
+                int data_len,
+                unsigned char* hash) override;
+  // SIMD hashing of a chunk per lane, see cpu_hash_lib/blake3.h
+  void get_hash(unsigned char* din,
+                int block_size,
+                unsigned char* dout,
+                int num_of_blocks) override;
+};
+
+// XXH3 with 128-bit digests: a checksum, not a cryptographic hash. Only for
+// trees that catch corruption of data nobody has a reason to forge.
+class XXH3_128 : public Hasher {
+ public:
+  using Hasher::get_hash;
+  XXH3_128();
+  void get_hash(unsigned char* data,
+                int data_len,
+                unsigned char* hash) override;
+};
+
 class SHA_256_GPU : public Hasher {
  public:
   SHA_256_GPU();
@@ -89,7 +158,9 @@ class MD_5_GPU : public Hasher {
 class Block {
   public:
    unsigned char* data;
+   size_t size = BLOCK_SIZE;
    Block();
+   Block(size_t size_);
 };
 
 // Collection of blocks
@@ -102,9 +173,32 @@ class Blocks {
    Blocks() {}
    ~Blocks();
    Blocks(unsigned char* data, int data_len);
+   Blocks(unsigned char* data, int data_len, size_t block_size);
    void add_blocks(Blocks& new_blocks);
 };
 
+// A fixed-size pool of worker threads for the CPU build
+class ThreadPool {
+ private:
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mtx;
+  std::condition_variable task_cv;
+  std::condition_variable done_cv;
+  unsigned int busy;
+  bool stopping;
+
+  void worker_loop();
+
+ public:
+  ThreadPool(unsigned int num_threads);
+  ~ThreadPool();
+  unsigned int size() const;
+  // run fn(begin, end) over chunks of [0, n) on all threads (the caller
+  // included) and return when every chunk is done
+  void parallel_for(size_t n, std::function<void(size_t, size_t)> fn);
+};
+
 // MerkleNode and its constructors
 class MerkleNode {
  public:
@@ -132,11 +226,298 @@ class MerkleNode {
 };
 
 
+// New data for an existing leaf; data_len is at most the block size of the
+// tree and the data is zero-padded to a full block
+struct LeafUpdate {
+  size_t leaf_index;
+  unsigned char* data;
+  int data_len;
+};
+
+// A key of a SparseMerkleTree, SparseMerkleTree::kKeyLen bytes, and the new
+// value of it
+struct SparseUpdate {
+  unsigned char key[32];
+  unsigned char* value;
+  int value_len;
+};
+
+// Content-defined chunking of the leaves of a tree: a leaf ends where a
+// rolling hash of the bytes before it matches, instead of every block_size
+// bytes, so inserting or deleting data only changes the leaves around the
+// edit. Leaves are min_size to max_size bytes, avg_size on average; see
+// cpu_hash_lib/fastcdc.h.
+struct ChunkingParams {
+  size_t min_size = 2048;
+  size_t avg_size = 8192;
+  size_t max_size = 65536;
+};
+
+// How to build a MerkleTree or a FlatMerkleTree. The defaults give a binary
+// tree of BLOCK_SIZE-byte leaves built on one thread; set only what differs:
+//   TreeOptions options;
+//   options.num_threads = 8;
+//   options.block_size = 4096;
+//   FlatMerkleTree flat_tree(data, data_len, hasher, options);
+struct TreeOptions {
+  // ACCEL_CPU_CREATION and/or ACCEL_CPU_REDUCTION to spread those steps over
+  // num_threads threads; MerkleTree only, FlatMerkleTree always spreads them
+  unsigned short accel_mask = NO_ACCEL;
+  unsigned int num_threads = 1;
+  // children per parent, 2 or more; FlatMerkleTree only
+  unsigned int arity = 2;
+  // bytes of data per leaf
+  size_t block_size = BLOCK_SIZE;
+  // cut the leaves by content-defined chunking with chunking instead of into
+  // blocks of block_size bytes; FlatMerkleTree only
+  bool content_defined = false;
+  ChunkingParams chunking;
+};
+
+// An inclusion proof in raw digests: the digest of a leaf, and the digests of
+// its siblings from the leaf up to the root, back to back, with the side of
+// each sibling
+struct MerkleProof {
+  std::vector<unsigned char> leaf_hash;
+  std::vector<unsigned char> sibling_hashes;
+  std::vector<LeftOrRightSib> lrs;
+};
+
+// The proof of a leaf of a FlatMerkleTree of any arity. The path from the
+// leaf goes up through one group of children per level, hashed together into
+// their parent: group_sizes[i] children, the path's node at positions[i]
+// among them. sibling_hashes holds the other children of each group in
+// order, level by level. A group of one child is carried up and is left out.
+struct KaryMerkleProof {
+  std::vector<unsigned char> leaf_hash;
+  std::vector<unsigned char> sibling_hashes;
+  std::vector<unsigned int> positions;
+  std::vector<unsigned int> group_sizes;
+};
+
+// A proof for many leaves at once. The number of leaves fixes the shape of
+// the tree, and with the sorted leaf indices it tells which nodes the
+// verifier cannot compute itself; hashes holds the digests of those nodes,
+// each once, level by level from the leaves up, left to right.
+struct MerkleMultiProof {
+  size_t num_of_leaves = 0;
+  std::vector<size_t> leaf_indices;
+  std::vector<unsigned char> hashes;
+};
+
+// A proof for the run of leaves [first, last) of a tree of num_of_leaves
+// leaves and arity children per parent. On each level the run of nodes the
+// verifier computes is widened to whole groups by the nodes left and right
+// of it, which hashes holds level by level from the leaves up, the left ones
+// before the right ones. That is at most 2 (arity - 1) digests per level
+// however long the run is.
+struct MerkleRangeProof {
+  size_t num_of_leaves = 0;
+  unsigned int arity = 2;
+  size_t first = 0;
+  size_t last = 0;
+  std::vector<unsigned char> hashes;
+};
+
+// A proof that a key of a SparseMerkleTree holds a value, or holds none. The
+// path from the root follows the bits of the key, the most significant first,
+// down to a subtree of one leaf or none. empty_siblings has one entry per
+// depth of the path, from the root down, and the siblings that are not empty
+// subtrees are in sibling_hashes, in the same order. A path ending at an
+// empty subtree, or at the leaf of another key, proves the key is not there.
+struct SparseMerkleProof {
+  std::vector<bool> empty_siblings;
+  std::vector<unsigned char> sibling_hashes;
+  // the key and value digest of the leaf the path ends at; both empty if it
+  // ends at an empty subtree
+  std::vector<unsigned char> leaf_key;
+  std::vector<unsigned char> leaf_value_hash;
+};
+
+// Bump allocator for the MerkleNodes of a tree and their digests. Nodes are
+// carved out of large slabs, a whole run of them per call, and are never
+// freed one by one: clear() or the destructor drops every slab at once, so a
+// tree costs one allocation per slab instead of two per node.
+class NodeArena {
+ private:
+  static constexpr size_t kSlabSize = 1 << 20;
+  std::vector<std::unique_ptr<unsigned char[]>> slabs;
+  unsigned char* next = nullptr;
+  size_t bytes_left = 0;
+  size_t total_bytes = 0;
+
+ public:
+  // num_of_nodes unlinked nodes, back to back, each with its own digest
+  // buffer of digest_len bytes from the same slab
+  MerkleNode* new_nodes(size_t num_of_nodes, unsigned int digest_len) {
+    size_t node_bytes = num_of_nodes * sizeof(MerkleNode);
+    size_t bytes = node_bytes + num_of_nodes * digest_len;
+    size_t padding = -(uintptr_t)next % alignof(MerkleNode);
+    if (padding + bytes > bytes_left) {
+      size_t slab_size = std::max(bytes, kSlabSize);
+      slabs.emplace_back(new unsigned char[slab_size]);
+      next = slabs.back().get();
+      bytes_left = slab_size;
+      total_bytes += slab_size;
+      padding = 0;
+    }
+    MerkleNode* nodes = (MerkleNode*)(next + padding);
+    unsigned char* hashes = next + padding + node_bytes;
+    for (size_t i = 0; i < num_of_nodes; i++) {
+      new (nodes + i) MerkleNode();
+      nodes[i].hash = hashes + i * digest_len;
+      nodes[i].digest_len = digest_len;
+    }
+    next += padding + bytes;
+    bytes_left -= padding + bytes;
+    return nodes;
+  }
+  void clear() {
+    slabs.clear();
+    next = nullptr;
+    bytes_left = 0;
+    total_bytes = 0;
+  }
+  size_t num_of_slabs() const {
+    return slabs.size();
+  }
+  size_t bytes() const {
+    return total_bytes;
+  }
+};
+
+// Open addressing hash table from fixed-size binary digests to leaf indices,
+// a CPU counterpart of cuda_hashmap_lib/src/linearprobing.cu keyed by the
+// whole digest. Each slot holds a digest and its value side by side. The
+// digests are uniformly distributed already, so their first bytes are used
+// as the slot hash.
+class DigestMap {
+ private:
+  unsigned int digest_len = 0;
+  size_t slot_size = sizeof(size_t);
+  size_t count = 0;
+  size_t mask = 0;
+  std::vector<unsigned char> slots;
+
+  size_t home_of(const unsigned char* digest) const {
+    uint64_t h = 0;
+    memcpy(&h, digest, std::min<size_t>(digest_len, sizeof(h)));
+    return h & mask;
+  }
+  unsigned char* key_at(size_t slot) {
+    return slots.data() + slot * slot_size;
+  }
+  const unsigned char* key_at(size_t slot) const {
+    return slots.data() + slot * slot_size;
+  }
+  size_t value_at(size_t slot) const {
+    size_t value;
+    memcpy(&value, key_at(slot) + digest_len, sizeof(value));
+    return value;
+  }
+  void set_value_at(size_t slot, size_t value) {
+    memcpy(key_at(slot) + digest_len, &value, sizeof(value));
+  }
+  // the slot holding digest, or the empty slot where it would go
+  size_t slot_of(const unsigned char* digest) const {
+    size_t slot = home_of(digest);
+    while (value_at(slot) != npos &&
+           memcmp(key_at(slot), digest, digest_len) != 0) {
+      slot = (slot + 1) & mask;
+    }
+    return slot;
+  }
+  void rehash(size_t num_of_slots) {
+    std::vector<unsigned char> old_slots(num_of_slots * slot_size);
+    old_slots.swap(slots);
+    mask = num_of_slots - 1;
+    for (size_t slot = 0; slot < num_of_slots; slot++) {
+      set_value_at(slot, npos);
+    }
+    for (size_t offset = 0; offset < old_slots.size(); offset += slot_size) {
+      size_t value;
+      memcpy(&value, old_slots.data() + offset + digest_len, sizeof(value));
+      if (value != npos) {
+        size_t slot = slot_of(old_slots.data() + offset);
+        memcpy(key_at(slot), old_slots.data() + offset, slot_size);
+      }
+    }
+  }
+
+ public:
+  static const size_t npos = SIZE_MAX;
+
+  DigestMap() {}
+  DigestMap(unsigned int digest_len_) { reset(digest_len_); }
+
+  // drop all entries and take digests of digest_len_ bytes from now on
+  void reset(unsigned int digest_len_) {
+    digest_len = digest_len_;
+    slot_size = digest_len + sizeof(size_t);
+    count = 0;
+    slots.clear();
+    rehash(16);
+  }
+  // make room for num_of_entries entries without growing
+  void reserve(size_t num_of_entries) {
+    size_t num_of_slots = mask + 1;
+    while (num_of_entries * 4 > num_of_slots * 3) {
+      num_of_slots *= 2;
+    }
+    if (num_of_slots != mask + 1) {
+      rehash(num_of_slots);
+    }
+  }
+  size_t size() const { return count; }
+
+  // return the value of digest, or npos if it is not in the map
+  size_t find(const unsigned char* digest) const {
+    if (slots.empty()) {
+      return npos;
+    }
+    return value_at(slot_of(digest));
+  }
+  // map digest to value, replacing the old value if there is one
+  void insert(const unsigned char* digest, size_t value) {
+    reserve(count + 1);
+    size_t slot = slot_of(digest);
+    if (value_at(slot) == npos) {
+      memcpy(key_at(slot), digest, digest_len);
+      count++;
+    }
+    set_value_at(slot, value);
+  }
+  // remove digest; the entries after it in its probe run are moved back, so
+  // no tombstones are left behind
+  void erase(const unsigned char* digest) {
+    if (find(digest) == npos) {
+      return;
+    }
+    size_t hole = slot_of(digest);
+    count--;
+    for (size_t slot = (hole + 1) & mask; value_at(slot) != npos;
+         slot = (slot + 1) & mask) {
+      // move the entry back unless its home lies in (hole, slot]
+      size_t home = home_of(key_at(slot));
+      if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+        memcpy(key_at(hole), key_at(slot), slot_size);
+        hole = slot;
+      }
+    }
+    set_value_at(hole, npos);
+  }
+};
+
 // MerkleTree, its constructors and verify functions
 class MerkleTree {
  private:
   std::vector<MerkleNode*> hashes;
   std::unordered_map<std::string, MerkleNode*> hash_leaf_map;
+  // the index of each leaf in levels[0] by its digest, for the CPU version
+  DigestMap leaf_index_map;
+  // for each leaf whose digest other leaves have too, the previous and next
+  // leaf in a ring of the leaves with that digest
+  std::unordered_map<size_t, std::pair<size_t, size_t>> leaf_copies;
   Hasher* hasher;
   KeyValue* gpu_hash_leaf_map;
 
@@ -147,7 +528,24 @@ class MerkleTree {
   LeftOrRightSib* lrs;
   unsigned int arr_size;
 
+  // for CPU multithreaded construction
+  unsigned int num_threads = 1;
+  // bytes of data per leaf
+  size_t block_len = BLOCK_SIZE;
+
+  // every layer of the tree, leaves first; an orphan carried up to the next
+  // layer appears in both of them as the same node
+  std::vector<std::vector<MerkleNode*>> levels;
+  // owns every node of levels and their digests, for the CPU version
+  NodeArena node_arena;
+
   void delete_tree_walker(MerkleNode* cur_node);
+  void index_leaves(size_t first);
+  void add_leaf_index(size_t leaf_index);
+  void remove_leaf_index(size_t leaf_index);
+  void rehash_nodes(MerkleNode** nodes, size_t num_of_nodes);
+  MerkleNode* rehash_levels(size_t first_dirty, ThreadPool& pool);
+  void append_leaves(std::vector<MerkleNode*>& new_leaves);
   MerkleNode* make_tree_from_hashes(std::vector<MerkleNode *>& cur_layer_nodes);
   MerkleNode* make_tree_from_blocks(Blocks& blocks);
   bool verify(MerkleNode cur_node, std::vector<MerkleNode*>& siblings);
@@ -156,9 +554,16 @@ class MerkleTree {
   MerkleNode* make_tree_no_accel(unsigned char* data, unsigned int data_len);
   MerkleNode* make_tree_gpu_accel(unsigned char* data, unsigned int data_len,
                                   unsigned short accel_mask);
+  MerkleNode* make_tree_cpu_accel(unsigned char* data, size_t data_len,
+                                  unsigned short accel_mask,
+                                  MappedFile* file = nullptr);
+  MerkleNode* make_tree_from_hashes(std::vector<MerkleNode *>& cur_layer_nodes,
+                                    ThreadPool& pool);
+
+  friend class MerkleTreeDigestSource;
 
 public:
-  MerkleNode* root;
+  MerkleNode* root = nullptr;
   void print();
   void print_root_hash();
   std::string root_hash();
@@ -166,29 +571,571 @@ public:
 
   MerkleTree() {}
   MerkleTree(Hasher* hasher_);
+  // an empty tree to append leaves of options.block_size bytes to
+  MerkleTree(Hasher* hasher_, const TreeOptions& options);
   MerkleTree(Blocks& blocks_, Hasher* hasher_);
   MerkleTree(unsigned char* data, int data_len, Hasher* hasher_);
   MerkleTree(unsigned char* data, int data_len, Hasher* hasher_,
              unsigned short accel_mask);
+  MerkleTree(unsigned char* data, int data_len, Hasher* hasher_,
+             const TreeOptions& options);
+  // hash a file straight from its mapping in memory
+  MerkleTree(std::string path, Hasher* hasher_,
+             const TreeOptions& options = TreeOptions());
 
+  size_t block_size() const;
   void delete_tree();
+  // the arena holding the nodes of the tree, for the CPU version
+  const NodeArena& arena() const;
   void append(Blocks& new_blocks);
   void append(unsigned char* data, int data_len);
+  bool update(size_t leaf_index, unsigned char* data, int data_len);
+  bool update(std::vector<LeafUpdate>& updates);
 
   MerkleNode* find_leaf(std::string hash_str);
+  MerkleNode* find_leaf(unsigned char* hash);
   std::vector<MerkleNode*> find_siblings(MerkleNode* leaf);
   std::vector<MerkleNode> find_siblings(std::string hash_str);
+  MerkleProof find_proof(size_t leaf_index);
+  MerkleMultiProof find_multiproof(std::vector<size_t> leaf_indices);
+  MerkleMultiProof find_multiproof(unsigned char* leaf_hashes,
+                                   size_t num_of_hashes);
+  MerkleRangeProof find_range_proof(size_t first, size_t last);
+  // write all levels to a tree file that FlatMerkleTree::load() reopens
+  bool save(std::string path);
 
   bool verify(unsigned char* data, int data_len);
   bool verify(Block& block);
   bool verify(std::string hash_str);
+  bool verify(unsigned char* hash);
   bool verify(std::string hash_str, std::vector<MerkleNode> &siblings,
               std::string root_hash);
 };
 
+// The order the nodes of a FlatMerkleTree are stored in
+enum NodeLayout {
+  // level by level, leaves first
+  LAYOUT_LEVEL_ORDER,
+  // the root, then blocks of about a page, each a group of siblings and
+  // their descendants a few levels down, with the blocks of the top levels
+  // first; a path from the root to a leaf touches one block per few levels
+  // instead of one distant spot per level
+  LAYOUT_BLOCKED
+};
+
+// MerkleTree stored level by level in one contiguous buffer of digests.
+// Node j of a level is the parent of nodes 2j and 2j + 1 of the level below;
+// an orphan at the end of a level is copied up unchanged, so the root is the
+// same as the one of MerkleTree.
+class FlatMerkleTree {
+ private:
+  Hasher* hasher;
+  unsigned int digest_len;
+  unsigned int num_threads = 1;
+  // number of children hashed into each parent; the last group of a level
+  // may be smaller, and a group of one is carried up as it is
+  unsigned int branching_factor = 2;
+  // bytes of data per leaf
+  size_t block_len = BLOCK_SIZE;
+  // leaves cut by content-defined chunking with chunking, if set, instead of
+  // blocks of block_len bytes
+  bool content_defined = false;
+  ChunkingParams chunking;
+  // the end offset in the data of each content-defined leaf
+  std::vector<size_t> chunk_ends;
+  // digests of all levels back to back, leaves first
+  std::vector<unsigned char> nodes;
+  // index of the first node of each level, plus the total number of nodes
+  std::vector<size_t> level_offsets;
+  // leaf indices sorted by their digests, to look up leaves by hash without
+  // keeping a second copy of every digest
+  std::vector<size_t> sorted_leaves;
+  // the saved tree file the tree was loaded from, if any; nodes and
+  // sorted_leaves are then read from its mapping instead
+  std::shared_ptr<MappedFile> tree_file;
+  size_t saved_nodes_offset = 0;
+  size_t saved_leaves_offset = 0;
+  size_t saved_chunk_ends_offset = 0;
+
+  // where the nodes of a level sit in LAYOUT_BLOCKED. Node i of the level is
+  // in block i / span of the band of levels the level is in.
+  struct BlockedLevel {
+    // first node of the band, and the nodes of a full block of it
+    size_t base;
+    size_t block_nodes;
+    // nodes of the level in a full block, and the nodes of the levels above
+    // it in the block
+    size_t span;
+    size_t prefix;
+    // log2(span) if it is a power of 2, to find the block with a shift
+    int span_shift;
+    // the last block of the band is cut short by the end of each level
+    size_t last_block;
+    size_t last_prefix;
+  };
+  NodeLayout node_layout = LAYOUT_LEVEL_ORDER;
+  std::vector<BlockedLevel> blocked_levels;
+
+  size_t layout_levels(size_t num_of_leaves);
+  void layout_blocks();
+  size_t node_offset(NodeLayout layout, size_t level, size_t index) const;
+  void make_levels(size_t num_of_leaves);
+  const size_t* leaf_order();
+  const size_t* leaf_ends();
+  std::pair<size_t, size_t> group_of(size_t level, size_t index);
+  void prefetch_path(size_t leaf_index);
+  void make_tree_from_data(unsigned char* data, size_t data_len,
+                           MappedFile* file = nullptr);
+  bool verify(size_t leaf_index);
+
+  friend class FlatTreeDigestSource;
+
+ public:
+  void print();
+  void print_root_hash();
+  std::string root_hash();
+
+  FlatMerkleTree(Hasher* hasher_);
+  FlatMerkleTree(unsigned char* data, int data_len, Hasher* hasher_,
+                 const TreeOptions& options = TreeOptions());
+  // hash a file straight from its mapping in memory
+  FlatMerkleTree(std::string path, Hasher* hasher_,
+                 const TreeOptions& options = TreeOptions());
+
+  unsigned int arity() const;
+  size_t block_size() const;
+  // reorder the nodes of a built tree; proofs and lookups work the same in
+  // either layout. Returns false for a tree loaded from a file, which is used
+  // in place in level order.
+  bool set_layout(NodeLayout layout);
+  NodeLayout layout() const;
+  // the chunking of a tree of content-defined leaves, nullptr for blocks
+  const ChunkingParams* chunking_params() const;
+  // the bytes [first, second) of the data in a leaf; the last block of a
+  // tree of blocks is given in full even where the data ends before it
+  std::pair<size_t, size_t> leaf_range(size_t leaf_index);
+  // the leaf holding the byte at offset of the data, or num_of_leaves() if
+  // none; for finding the leaves an edit of the data touches
+  size_t leaf_at(size_t offset);
+  size_t num_of_leaves() const;
+  size_t num_of_levels() const;
+  size_t level_size(size_t level) const;
+  unsigned char* node_hash(size_t level, size_t index);
+  // return the index of the leaf with hash_str, or num_of_leaves() if none
+  size_t find_leaf(std::string hash_str);
+  size_t find_leaf(unsigned char* hash);
+
+  // siblings point into the tree; they stay valid as long as the tree does.
+  // Siblings, proofs and multiproofs only describe binary trees, and are
+  // empty for a tree of another arity; find_kary_proof() works for all.
+  std::vector<MerkleNode> find_siblings(size_t leaf_index);
+  std::vector<MerkleNode> find_siblings(std::string hash_str);
+  MerkleProof find_proof(size_t leaf_index);
+  KaryMerkleProof find_kary_proof(size_t leaf_index);
+  MerkleMultiProof find_multiproof(std::vector<size_t> leaf_indices);
+  MerkleMultiProof find_multiproof(unsigned char* leaf_hashes,
+                                   size_t num_of_hashes);
+  // the proof of the leaves [first, last), of any arity; empty if the range
+  // is empty or out of range
+  MerkleRangeProof find_range_proof(size_t first, size_t last);
+
+  // cuts data into leaves as the tree does, so data has to start at the
+  // start of a leaf
+  bool verify(unsigned char* data, int data_len);
+  bool verify(Block& block);
+  bool verify(std::string hash_str);
+  bool verify(unsigned char* hash);
+
+  // write all levels to a tree file, see merkle_tree_cpu/tree_file.cpp;
+  // returns false on an I/O error or if the hasher has no id
+  bool save(std::string path);
+  // replace the tree with the one saved at path, mapped instead of read, so
+  // it serves proofs right away without the source data, with the arity,
+  // block size and chunking it was saved with. Returns false, leaving the
+  // tree as it was, if the file is not a tree saved with this tree's hasher.
+  bool load(std::string path);
+};
+
+// The node digests of a tree, level by level, as diff_trees() reads them. A
+// source may stand for a replica elsewhere: each fetch_digests() call is one
+// batch, one round trip to the replica.
+class TreeDigestSource {
+ public:
+  virtual HasherId hasher_id() = 0;
+  virtual unsigned int digest_length() = 0;
+  virtual unsigned int arity() = 0;
+  virtual size_t num_of_leaves() = 0;
+  // copy the digests of the nodes at indices of level, back to back, into
+  // digests; returns false if they cannot be had
+  virtual bool fetch_digests(size_t level, const std::vector<size_t>& indices,
+                             unsigned char* digests) = 0;
+  virtual ~TreeDigestSource() {}
+};
+
+// The digests of a FlatMerkleTree in this process, read in place
+class FlatTreeDigestSource : public TreeDigestSource {
+ private:
+  FlatMerkleTree& tree;
+
+ public:
+  FlatTreeDigestSource(FlatMerkleTree& tree_);
+  HasherId hasher_id() override;
+  unsigned int digest_length() override;
+  unsigned int arity() override;
+  size_t num_of_leaves() override;
+  bool fetch_digests(size_t level, const std::vector<size_t>& indices,
+                     unsigned char* digests) override;
+};
+
+// The digests of a MerkleTree in this process, for the CPU version
+class MerkleTreeDigestSource : public TreeDigestSource {
+ private:
+  MerkleTree& tree;
+
+ public:
+  MerkleTreeDigestSource(MerkleTree& tree_);
+  HasherId hasher_id() override;
+  unsigned int digest_length() override;
+  unsigned int arity() override;
+  size_t num_of_leaves() override;
+  bool fetch_digests(size_t level, const std::vector<size_t>& indices,
+                     unsigned char* digests) override;
+};
+
+// Cost of a diff_trees() run on the remote side
+struct TreeDiffStats {
+  // fetch_digests() calls, one per level walked
+  size_t round_trips = 0;
+  size_t digests_fetched = 0;
+};
+
+// Find the leaves in which two trees differ, as ranges [first, second) of
+// leaf indices, in order. Both trees are walked from the top level they have
+// in common down, and only the children of differing nodes are fetched, so d
+// differing leaves out of n cost O(d k log n) digests, in one batch per
+// level from remote. Leaves only one tree has differ; trees of different
+// hashers or arities differ everywhere. Returns false if a fetch fails.
+bool diff_trees(TreeDigestSource& local, TreeDigestSource& remote,
+                std::vector<std::pair<size_t, size_t>>& ranges,
+                TreeDiffStats* stats = nullptr);
+
+// Computes the root hash of data fed in chunks of any size. Only the pending
+// partial block and one full subtree root per level are kept, never the whole
+// tree; the root is the same as the one of MerkleTree built from all the data
+// at once.
+class StreamingMerkleTree {
+ private:
+  Hasher* hasher;
+  unsigned int digest_len;
+  ThreadPool pool;
+  size_t block_len = BLOCK_SIZE;
+  // bytes of the current block that is not full yet
+  std::vector<unsigned char> partial_block;
+  // frontier[l] is the root of a full subtree of 2^l leaves; it is pending
+  // whenever bit l of leaf_count is set
+  std::vector<unsigned char> frontier;
+  unsigned long long leaf_count;
+  // two digests to be hashed into a parent
+  std::vector<unsigned char> pair_buffer;
+
+  void add_leaf_hash(unsigned char* hash);
+
+ public:
+  StreamingMerkleTree(Hasher* hasher_);
+  StreamingMerkleTree(Hasher* hasher_, unsigned int num_threads);
+  StreamingMerkleTree(Hasher* hasher_, unsigned int num_threads,
+                      size_t block_size_);
+
+  void update(unsigned char* data, size_t data_len);
+  // add leaves hashed elsewhere, back to back in hashes; only at a block
+  // boundary, so returns false if a partial block is pending
+  bool add_leaf_hashes(unsigned char* hashes, size_t num_of_hashes);
+  // root over everything fed so far, with the partial block zero-padded as
+  // the last leaf; more data can still be fed afterwards
+  void finalize(unsigned char* root);
+  std::string root_hash();
+  unsigned long long num_of_leaves() const;
+  size_t block_size() const;
+};
+
+// A binary tree that one writer appends to while any number of threads read
+// proofs from it, without locks. The nodes of full subtrees never change once
+// hashed, so they are stored in segments that are never moved or freed until
+// the tree is. Each append publishes a snapshot of the tree: its number of
+// leaves and the digests on its right edge that later appends will change.
+// A Reader pins the snapshot current when it is made, so all its proofs are
+// against one root, however many appends happen meanwhile.
+//
+// Old snapshots are reclaimed by epochs: a Reader announces the epoch it
+// started in, and the writer frees a snapshot it replaced in an earlier epoch
+// than any Reader announced. Hold a Reader for a batch of proofs, not for
+// good, or the replaced snapshots pile up. The tree has the shape, and so
+// the root, of a MerkleTree appended the same data.
+class ConcurrentMerkleTree {
+ public:
+  // Readers held at once; making one more waits for one to go
+  static const size_t kMaxReaders = 128;
+
+ private:
+  static const size_t kMaxLevels = 64;
+  // segment s of a level holds the nodes [kSegmentBase (2^s - 1),
+  // kSegmentBase (2^(s + 1) - 1)), so a few dozen segments hold any tree
+  static const size_t kSegmentBase = 1024;
+  static const size_t kMaxSegments = 54;
+
+  // the tree as of one append
+  struct Snapshot {
+    size_t num_of_leaves;
+    size_t num_of_levels;
+    // the digest of the last node of each level that is not a full subtree
+    // yet, where the level has one
+    std::vector<unsigned char> edges;
+    std::vector<unsigned char> root;
+  };
+  // a replaced snapshot, and the epoch it was replaced in
+  struct Retired {
+    Snapshot* snapshot;
+    uint64_t epoch;
+  };
+  // the epoch a Reader started in, or 0 if the slot is free; a cache line
+  // each, so that readers do not share them
+  struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch{0};
+  };
+
+  Hasher* hasher;
+  unsigned int digest_len;
+  size_t block_len = BLOCK_SIZE;
+  ThreadPool pool;
+  // digests of the full subtrees of each level, written once by the writer
+  std::unique_ptr<unsigned char[]> segments[kMaxLevels][kMaxSegments];
+  std::atomic<Snapshot*> current{nullptr};
+  std::atomic<uint64_t> global_epoch{1};
+  // taken by Readers of a const tree
+  mutable ReaderSlot slots[kMaxReaders];
+  // only touched by the writer
+  std::vector<Retired> retired;
+  std::vector<unsigned char> pair_buffer;
+
+  unsigned char* node(size_t level, size_t index) const;
+  unsigned char* new_node(size_t level, size_t index);
+  void publish(size_t num_of_leaves);
+  void reclaim();
+
+ public:
+  // the snapshot current when the Reader was made, safe to use until the
+  // Reader goes
+  class Reader {
+   private:
+    const ConcurrentMerkleTree* tree;
+    ReaderSlot* slot;
+    const Snapshot* snapshot;
+
+   public:
+    Reader(const ConcurrentMerkleTree& tree_);
+    ~Reader();
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    size_t num_of_leaves() const;
+    // the raw root digest, empty for a tree without leaves
+    const std::vector<unsigned char>& root() const;
+    std::string root_hash() const;
+    // the proof of a leaf against root(), as MerkleTree::find_proof(); empty
+    // if leaf_index is out of range
+    MerkleProof find_proof(size_t leaf_index) const;
+  };
+
+  ConcurrentMerkleTree(Hasher* hasher_);
+  ConcurrentMerkleTree(Hasher* hasher_, unsigned int num_threads,
+                       size_t block_size_);
+  // every Reader has to be gone first
+  ~ConcurrentMerkleTree();
+  ConcurrentMerkleTree(const ConcurrentMerkleTree&) = delete;
+  ConcurrentMerkleTree& operator=(const ConcurrentMerkleTree&) = delete;
+
+  // the writer side, from one thread at a time. data is cut into blocks of
+  // its own, the last one zero-padded, as MerkleTree::append() does.
+  void append(unsigned char* data, size_t data_len);
+  void append_leaf_hashes(unsigned char* hashes, size_t num_of_hashes);
+  size_t block_size() const;
+  // snapshots replaced but not reclaimed yet, for the writer
+  size_t num_of_retired() const;
+};
+
+// A commitment to a map of 256-bit keys to values, as a binary tree of 2^256
+// leaves where all but the keys set are empty. Only the keys set take nodes:
+//  - an empty subtree has the digest of its height, precomputed, and a
+//    subtree of one key has the digest of its leaf, H(0x00 | key | H(value)),
+//    however high it is;
+//  - a node is stored only where the keys below it split, and the levels
+//    between it and its parent, where only it is not empty, are hashed with
+//    the empty digests but not stored.
+// So a tree of n random keys has 2n - 1 nodes and proofs of about log2(n)
+// digests.
+//
+// update() sorts a batch by key and merges it into the tree top down, so a
+// node above many of the keys is rehashed once for all of them. The nodes it
+// touched are then rehashed from the bottom up, those at the same depth on
+// all threads. Keys cannot be removed.
+class SparseMerkleTree {
+ public:
+  static const size_t kKeyLen = 32;
+  static const size_t kKeyBits = kKeyLen * 8;
+
+ private:
+  static const uint32_t kNoNode = UINT32_MAX;
+
+  // a leaf, with bit kKeyBits, or a node where the keys below it split on
+  // bit: all of them share the bits before it, as key does
+  struct Node {
+    unsigned char key[kKeyLen];
+    uint32_t children[2];
+    uint16_t bit;
+    // the depth of the subtree the node stands for, one below its parent
+    uint16_t top;
+  };
+
+  Hasher* hasher;
+  unsigned int digest_len;
+  ThreadPool pool;
+  std::vector<Node> nodes;
+  // two digests per node: the value digest of a leaf, or the digest of a
+  // node where it splits; then the digest of the subtree at its top
+  std::vector<unsigned char> digests;
+  std::vector<uint32_t> free_nodes;
+  // the digest of an empty subtree of each height, 0 to kKeyBits
+  std::vector<unsigned char> empty_digests;
+  uint32_t root_node = kNoNode;
+  size_t num_of_keys = 0;
+
+  // the update being merged: its keys sorted, and their value digests
+  std::vector<const unsigned char*> batch_keys;
+  std::vector<unsigned char> batch_value_hashes;
+  // the nodes to rehash, by bit
+  std::vector<std::vector<uint32_t>> dirty;
+
+  unsigned char* node_digest(uint32_t node);
+  unsigned char* top_digest(uint32_t node);
+  uint32_t new_node();
+  uint32_t new_leaf(size_t entry, size_t top);
+  uint32_t build(size_t top, size_t lo, size_t hi, uint32_t leaf);
+  uint32_t merge(uint32_t node, size_t top, size_t lo, size_t hi);
+  void rehash(const uint32_t* run, size_t count, size_t bit);
+  void carry(const Node& node, size_t top, unsigned char* digest,
+             unsigned char* buffer) const;
+
+ public:
+  SparseMerkleTree(Hasher* hasher_);
+  SparseMerkleTree(Hasher* hasher_, unsigned int num_threads);
+
+  // set many keys at once; if a key is set more than once, the last one wins
+  void update(std::vector<SparseUpdate>& updates);
+  void update(const unsigned char* key, unsigned char* value, int value_len);
+  // copy the value digest of key into value_hash; false if it is not set
+  bool find(const unsigned char* key, unsigned char* value_hash) const;
+  // a proof that key holds its value if it is set, or that it is not
+  SparseMerkleProof find_proof(const unsigned char* key) const;
+  void root(unsigned char* root_hash) const;
+  std::string root_hash() const;
+  size_t size() const;
+  // the digest of an empty subtree height levels high
+  const unsigned char* empty_digest(size_t height) const;
+};
+
+// Throughput of each stage of a FileHashPipeline run. A reader waiting for
+// free buffers means hashing is the bottleneck; hash workers waiting for data
+// mean reading is.
+struct PipelineStats {
+  unsigned long long bytes = 0;
+  bool direct_io = false;
+  double total_seconds = 0;
+  // time the reader spent in read()
+  double read_seconds = 0;
+  // time the hash workers spent hashing, summed over all of them
+  double hash_seconds = 0;
+  // time the reader waited for a free buffer
+  double reader_wait_seconds = 0;
+  // time the hash workers waited for a filled buffer, summed over all of them
+  double hash_wait_seconds = 0;
+
+  void print(std::ostream& out);
+};
+
+// Hashes a file into a StreamingMerkleTree with reading and hashing
+// overlapped: a reader thread fills a ring of queue_depth aligned buffers,
+// hash workers hash the filled ones, and the calling thread feeds their leaf
+// digests to the tree in file order and hands the buffers back to the reader.
+// With direct_io the file is read with O_DIRECT, bypassing the page cache,
+// where the file system supports it.
+class FileHashPipeline {
+ private:
+  Hasher* hasher;
+  unsigned int num_workers;
+  unsigned int queue_depth;
+  size_t buffer_size;
+  bool direct_io;
+  size_t block_len;
+
+ public:
+  PipelineStats stats;
+
+  // hasher and block_size_ must be the ones of the trees the pipeline feeds
+  FileHashPipeline(Hasher* hasher_, unsigned int num_workers_,
+                   unsigned int queue_depth_, size_t buffer_size_,
+                   bool direct_io_);
+  FileHashPipeline(Hasher* hasher_, unsigned int num_workers_,
+                   unsigned int queue_depth_, size_t buffer_size_,
+                   bool direct_io_, size_t block_size_);
+
+  // feed the whole file at path to tree; returns false on an I/O error or if
+  // tree is not at a block boundary or has another block size
+  bool run(std::string path, StreamingMerkleTree& tree);
+};
+
 // Utility functions
 std::string hash_to_hex_string(unsigned char *hash, int size);
 void hex_string_to_hash(std::string hash_str, unsigned char* hash, int size);
+size_t num_of_blocks(size_t data_len);
+size_t num_of_blocks(size_t data_len, size_t block_size);
+// number of levels of a tree of num_of_leaves leaves and arity children per
+// parent, the leaves and the root included; 0 for no leaves
+size_t num_of_levels(size_t num_of_leaves, unsigned int arity);
+// a new Hasher by name: "sha256", "md5", "blake3" or "xxh3"; nullptr for any
+// other name
+Hasher* new_hasher(std::string name);
+// hash data in blocks of block_size bytes, BLOCK_SIZE if none is given
+void hash_blocks(unsigned char* data, size_t data_len, Hasher* hasher,
+                 unsigned char* hashes, ThreadPool& pool);
+void hash_blocks(unsigned char* data, size_t data_len, size_t block_size,
+                 Hasher* hasher, unsigned char* hashes, ThreadPool& pool);
+void hash_blocks(MappedFile& file, size_t block_size, Hasher* hasher,
+                 unsigned char* hashes, ThreadPool& pool);
+// the end offset of each content-defined chunk of data, in order
+std::vector<size_t> find_chunk_ends(unsigned char* data, size_t data_len,
+                                    const ChunkingParams& chunking);
+// hash the chunks of data ending at chunk_ends into hashes, one per chunk,
+// without padding
+void hash_chunks(unsigned char* data, const std::vector<size_t>& chunk_ends,
+                 Hasher* hasher, unsigned char* hashes, ThreadPool& pool);
+std::vector<bool> verify_proofs(std::vector<MerkleProof>& proofs,
+                                unsigned char* root_hash, Hasher* hasher,
+                                ThreadPool& pool);
+bool verify_multiproof(MerkleMultiProof& proof, unsigned char* leaf_hashes,
+                       unsigned char* root_hash, Hasher* hasher);
+bool verify_kary_proof(const KaryMerkleProof& proof, unsigned char* root_hash,
+                       Hasher* hasher);
+// leaf_hashes are the digests of the leaves [proof.first, proof.last), back
+// to back, e.g. from hash_blocks() over the data read
+bool verify_range_proof(const MerkleRangeProof& proof,
+                        unsigned char* leaf_hashes, unsigned char* root_hash,
+                        Hasher* hasher);
+// value_hash is the digest of the value key holds, or nullptr to check that
+// key holds none
+bool verify_sparse_proof(const SparseMerkleProof& proof,
+                         const unsigned char* key,
+                         const unsigned char* value_hash,
+                         unsigned char* root_hash, Hasher* hasher);
 
 
 #endif /* MERKLE_TREE_HPP */
@@ -1,6 +1,12 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <random>
 #include <string>
 #include <tuple>
 #include "../merkle_tree.hpp"
+#include "../static_merkle_tree.hpp"
+#include "../cpu_hash_lib/fastcdc.h"
 #include "../utils/testdata.hpp"
 #include "../utils/timer.hpp"
 
@@ -9,27 +15,449 @@ using namespace std;
 string PLATFORM = "CPU";
 string CACHE_PATH = "cached_test_data";
 
+// heap allocations made through operator new, reported with --allocs
+atomic<unsigned long long> num_of_allocations(0);
+
+void* operator new(size_t size) {
+  num_of_allocations.fetch_add(1, memory_order_relaxed);
+  void* p = malloc(size > 0 ? size : 1);
+  if (p == nullptr) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+// GCC cannot tell that this free() matches the malloc() in operator new
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { free(p); }
+#pragma GCC diagnostic pop
+
+void operator delete(void* p, size_t) noexcept { ::operator delete(p); }
+
+// time num_of_proofs proofs of random leaves of a tree, reported as its
+// own line of the CSV; proof(leaf_index) returns the size of the proof, summed
+// so the proofs are not optimized away
+template <typename Proof>
+size_t time_proofs(string name, size_t num_of_leaves, size_t num_of_proofs,
+                   Proof proof) {
+  mt19937_64 random(1);
+  vector<size_t> leaves(num_of_proofs);
+  for (auto& leaf : leaves) {
+    leaf = random() % num_of_leaves;
+  }
+  size_t total = 0;
+  start_timer(name);
+  for (size_t leaf : leaves) {
+    total += proof(leaf);
+  }
+  stop_timer();
+  print_timer_csv();
+  return total;
+}
+
+// build a StaticMerkleTree for the hash of Policy; returns its root hash.
+// 4 KiB blocks, the usual page size, get a tree with the block size fixed at
+// compile time.
+template <typename Policy>
+string static_root_hash(unsigned char* data, unsigned long long data_len,
+                        unsigned int num_threads, size_t block_size) {
+  if (block_size == 4096) {
+    StaticMerkleTree<Policy, 4096> smt(data, data_len, num_threads);
+    return smt.root_hash();
+  }
+  StaticMerkleTree<Policy> smt(data, data_len, num_threads, block_size);
+  return smt.root_hash();
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 3) {
     cerr << "Usage: ./benchmark_cpu <data_len> <block_size> [--no-cache]"
-         << endl;
+         << " [--threads=<num_threads>] [--flat] [--stream]"
+         << " [--pipeline[=<queue_depth>]] [--direct-io] [--allocs]"
+         << " [--static] [--hash=sha256|md5|blake3|xxh3] [--arity=<k>]"
+         << " [--cdc[=<avg_size>]] [--proofs[=<num_of_proofs>]]"
+         << " [--sparse[=<num_of_keys>]] [--concurrent]" << endl;
+    exit(1);
+  }
+  unsigned int num_threads = 0;
+  bool flat = false;
+  bool stream = false;
+  unsigned int queue_depth = 0;
+  bool direct_io = false;
+  bool allocs = false;
+  bool static_tree = false;
+  string hash_name = "sha256";
+  unsigned int arity = 0;
+  size_t cdc_avg_size = 0;
+  size_t num_of_proofs = 0;
+  size_t num_of_keys = 0;
+  bool concurrent = false;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--no-cache") == 0) {
+      CACHE_PATH = "NO_CACHE";
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      num_threads = stoi(argv[i] + 10);
+    } else if (strcmp(argv[i], "--flat") == 0) {
+      flat = true;
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+    } else if (strcmp(argv[i], "--pipeline") == 0) {
+      queue_depth = 4;
+    } else if (strncmp(argv[i], "--pipeline=", 11) == 0) {
+      queue_depth = stoi(argv[i] + 11);
+    } else if (strcmp(argv[i], "--direct-io") == 0) {
+      direct_io = true;
+    } else if (strcmp(argv[i], "--allocs") == 0) {
+      allocs = true;
+    } else if (strcmp(argv[i], "--static") == 0) {
+      static_tree = true;
+    } else if (strncmp(argv[i], "--hash=", 7) == 0) {
+      hash_name = argv[i] + 7;
+    } else if (strncmp(argv[i], "--arity=", 8) == 0) {
+      // only FlatMerkleTree has other arities than 2
+      arity = stoi(argv[i] + 8);
+      flat = true;
+    } else if (strcmp(argv[i], "--cdc") == 0) {
+      // only FlatMerkleTree has content-defined leaves
+      cdc_avg_size = 8192;
+      flat = true;
+    } else if (strncmp(argv[i], "--cdc=", 6) == 0) {
+      cdc_avg_size = stoull(argv[i] + 6);
+      flat = true;
+    } else if (strcmp(argv[i], "--proofs") == 0) {
+      num_of_proofs = 1000000;
+    } else if (strncmp(argv[i], "--proofs=", 9) == 0) {
+      num_of_proofs = stoull(argv[i] + 9);
+    } else if (strcmp(argv[i], "--sparse") == 0) {
+      num_of_keys = 1000000;
+    } else if (strncmp(argv[i], "--sparse=", 9) == 0) {
+      num_of_keys = stoull(argv[i] + 9);
+    } else if (strcmp(argv[i], "--concurrent") == 0) {
+      concurrent = true;
+    }
+  }
+  Hasher* hasher = new_hasher(hash_name);
+  if (hasher == nullptr) {
+    cerr << "Unknown hash " << hash_name << endl;
     exit(1);
-  } else if (argc == 4 && strcmp(argv[3], "--no-cache") == 0) {
-    CACHE_PATH = "NO_CACHE";
+  }
+  if (queue_depth > 0 && CACHE_PATH == "NO_CACHE") {
+    cerr << "--pipeline reads the cache file; drop --no-cache" << endl;
+    exit(1);
+  }
+  // multithreaded runs are reported as e.g. CPU_MT8
+  if (num_threads > 0) {
+    PLATFORM += "_MT" + to_string(num_threads);
+  }
+  if (flat) {
+    PLATFORM += "_FLAT";
+  }
+  if (arity > 0) {
+    PLATFORM += "_K" + to_string(arity);
+  }
+  if (cdc_avg_size > 0) {
+    PLATFORM += "_CDC" + to_string(cdc_avg_size);
+  }
+  if (static_tree) {
+    PLATFORM += "_STATIC";
+  }
+  if (stream) {
+    PLATFORM += "_STREAM";
+  }
+  if (concurrent) {
+    PLATFORM += "_CONCURRENT";
+  }
+  // runs with other hashes than SHA-256 are reported as e.g. CPU_BLAKE3
+  if (hasher->id() != HASHER_SHA_256) {
+    string suffix = hash_name;
+    transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+    PLATFORM += "_" + suffix;
+  }
+  if (queue_depth > 0) {
+    PLATFORM += "_PIPE" + to_string(queue_depth) + (direct_io ? "_DIO" : "");
   }
   string config = "";
   unsigned char* data = nullptr;
   unsigned long long data_len = stoull(argv[1]);
-  BLOCK_SIZE = stoi(argv[2]);
+  size_t block_size = stoi(argv[2]);
 
-  Hasher* hasher = new SHA_256();
-  TestData td(data_len, BLOCK_SIZE, PLATFORM, CACHE_PATH);
+  TestData td(data_len, block_size, PLATFORM, CACHE_PATH);
   tie(config, data, data_len) = td.get_test_data();
 
+  if (stream) {
+    // feed the data in 1 MiB chunks, as if read from a file
+    const unsigned long long chunk_size = 1 << 20;
+    start_timer(config);
+    StreamingMerkleTree smt(hasher, max(num_threads, 1u), block_size);
+    for (unsigned long long offset = 0; offset < data_len;
+         offset += chunk_size) {
+      smt.update(data + offset, min(chunk_size, data_len - offset));
+    }
+    string root_hash = smt.root_hash();
+    stop_timer();
+
+    cerr << root_hash << endl; // to stderr
+    print_timer_csv();
+    return 0;
+  }
+
+  if (concurrent) {
+    // one writer appends the data 64 blocks at a time while --threads
+    // readers check batches of proofs of random leaves, each batch against
+    // the root of its own Reader
+    unsigned int num_readers = max(num_threads, 1u);
+    unsigned int digest_len = hasher->hash_length();
+    ConcurrentMerkleTree cmt(hasher, 1, block_size);
+    atomic<bool> done(false);
+    atomic<size_t> num_of_checked(0);
+    atomic<size_t> num_of_bad(0);
+    vector<thread> readers;
+    for (unsigned int r = 0; r < num_readers; r++) {
+      readers.emplace_back([&, r]() {
+        mt19937_64 random(r + 1);
+        ThreadPool serial(1);
+        vector<unsigned char> leaf_hash(digest_len);
+        // a last batch after the writer is done checks the whole tree
+        bool last = false;
+        while (!last) {
+          last = done;
+          ConcurrentMerkleTree::Reader reader(cmt);
+          size_t num_of_leaves = reader.num_of_leaves();
+          if (num_of_leaves == 0) {
+            this_thread::yield();
+            continue;
+          }
+          vector<unsigned char> root = reader.root();
+          vector<size_t> leaves(64);
+          vector<MerkleProof> proofs;
+          for (auto& leaf : leaves) {
+            leaf = random() % num_of_leaves;
+            proofs.push_back(reader.find_proof(leaf));
+          }
+          vector<bool> results =
+              verify_proofs(proofs, root.data(), hasher, serial);
+          for (size_t i = 0; i < leaves.size(); i++) {
+            unsigned long long offset = leaves[i] * block_size;
+            hash_blocks(data + offset, min<unsigned long long>(
+                            block_size, data_len - offset),
+                        block_size, hasher, leaf_hash.data(), serial);
+            if (!results[i] || proofs[i].leaf_hash != leaf_hash) {
+              num_of_bad++;
+            }
+          }
+          num_of_checked += leaves.size();
+        }
+      });
+    }
+    const unsigned long long chunk_size = 64 * block_size;
+    size_t max_retired = 0;
+    start_timer(config);
+    for (unsigned long long offset = 0; offset < data_len;
+         offset += chunk_size) {
+      cmt.append(data + offset, min(chunk_size, data_len - offset));
+      max_retired = max(max_retired, cmt.num_of_retired());
+    }
+    stop_timer();
+    done = true;
+    for (auto& reader : readers) {
+      reader.join();
+    }
+
+    ConcurrentMerkleTree::Reader reader(cmt);
+    cerr << num_of_checked << " proofs checked by " << num_readers
+         << " readers, " << num_of_bad << " bad; retired snapshots: "
+         << max_retired << " at most, " << cmt.num_of_retired() << " left"
+         << endl;
+    cerr << reader.root_hash() << endl; // to stderr
+    print_timer_csv();
+    return num_of_bad == 0 ? 0 : 1;
+  }
+
+  if (queue_depth > 0) {
+    // read the cache file again in 8 MiB buffers while hashing; the mapping
+    // TestData made is not used
+    string path = CACHE_PATH + "/" + to_string(data_len) + ".dat";
+    FileHashPipeline pipeline(hasher, max(num_threads, 1u), queue_depth,
+                              8 << 20, direct_io, block_size);
+    start_timer(config);
+    StreamingMerkleTree smt(hasher, 1, block_size);
+    if (!pipeline.run(path, smt)) {
+      exit(1);
+    }
+    string root_hash = smt.root_hash();
+    stop_timer();
+
+    cerr << root_hash << endl; // to stderr
+    print_timer_csv();
+    pipeline.stats.print(cerr);
+    return 0;
+  }
+
+  if (static_tree) {
+    unsigned int threads = max(num_threads, 1u);
+    string root_hash;
+    start_timer(config);
+    switch (hasher->id()) {
+      case HASHER_MD_5:
+        root_hash = static_root_hash<MD5Policy>(data, data_len, threads,
+                                                block_size);
+        break;
+      case HASHER_BLAKE_3:
+        root_hash = static_root_hash<BLAKE3Policy>(data, data_len, threads,
+                                                   block_size);
+        break;
+      case HASHER_XXH3_128:
+        root_hash = static_root_hash<XXH3Policy>(data, data_len, threads,
+                                                 block_size);
+        break;
+      default:
+        root_hash = static_root_hash<SHA256Policy>(data, data_len, threads,
+                                                   block_size);
+        break;
+    }
+    stop_timer();
+
+    cerr << root_hash << endl; // to stderr
+    print_timer_csv();
+    return 0;
+  }
+
+  if (num_of_keys > 0) {
+    // random keys set to the blocks of the data in one batch, then a tenth of
+    // them set again, then a proof of each of those
+    string suffix = "," + to_string(num_of_keys) + "," + to_string(block_size);
+    size_t num_of_values = max<size_t>(data_len / block_size, 1);
+    mt19937_64 random(1);
+    vector<SparseUpdate> updates(num_of_keys);
+    for (size_t i = 0; i < num_of_keys; i++) {
+      for (size_t j = 0; j < SparseMerkleTree::kKeyLen; j += 8) {
+        uint64_t word = random();
+        memcpy(updates[i].key + j, &word, 8);
+      }
+      updates[i].value = data + (i % num_of_values) * block_size;
+      updates[i].value_len = min<unsigned long long>(block_size, data_len);
+    }
+    SparseMerkleTree smt(hasher, max(num_threads, 1u));
+    start_timer(PLATFORM + "_SPARSE_INSERT" + suffix);
+    smt.update(updates);
+    stop_timer();
+    print_timer_csv();
+
+    vector<SparseUpdate> changes(max<size_t>(num_of_keys / 10, 1));
+    for (auto& change : changes) {
+      change = updates[random() % num_of_keys];
+      change.value = data + random() % num_of_values * block_size;
+    }
+    start_timer(PLATFORM + "_SPARSE_UPDATE" + suffix);
+    smt.update(changes);
+    stop_timer();
+    print_timer_csv();
+
+    size_t num_of_digests = 0;
+    start_timer(PLATFORM + "_SPARSE_PROOFS" + suffix);
+    for (const auto& change : changes) {
+      num_of_digests += smt.find_proof(change.key).empty_siblings.size();
+    }
+    stop_timer();
+    print_timer_csv();
+    cerr << smt.size() << " keys, " << changes.size() << " proofs of "
+         << num_of_digests / changes.size() << " levels on average" << endl;
+    cerr << smt.root_hash() << endl; // to stderr
+    return 0;
+  }
+
+  // the trees of the modes below; MerkleTree spreads its work over threads
+  // only when --threads is given
+  TreeOptions options;
+  options.num_threads = max(num_threads, 1u);
+  options.arity = max(arity, 2u);
+  options.block_size = block_size;
+  if (num_threads > 0) {
+    options.accel_mask = ACCEL_CPU_CREATION | ACCEL_CPU_REDUCTION;
+  }
+
+  if (num_of_proofs > 0) {
+    // proofs of random leaves from the same data in each layout: MerkleTree
+    // nodes behind pointers, FlatMerkleTree in level order and in blocks
+    string suffix = "," + to_string(data_len) + "," + to_string(block_size);
+    unsigned int k = options.arity;
+    FlatMerkleTree fmt(data, data_len, hasher, options);
+    size_t num_of_leaves = fmt.num_of_leaves();
+    if (num_of_leaves == 0) {
+      exit(1);
+    }
+    auto flat_proof = [&](size_t leaf) {
+      return k == 2 ? fmt.find_proof(leaf).sibling_hashes.size()
+                    : fmt.find_kary_proof(leaf).sibling_hashes.size();
+    };
+    vector<size_t> totals;
+    if (k == 2) {
+      MerkleTree mt(data, data_len, hasher, options);
+      totals.push_back(time_proofs(
+          PLATFORM + "_PROOFS_POINTER" + suffix, num_of_leaves, num_of_proofs,
+          [&](size_t leaf) {
+            return mt.find_proof(leaf).sibling_hashes.size();
+          }));
+    }
+    totals.push_back(time_proofs(PLATFORM + "_PROOFS_LEVEL" + suffix,
+                                 num_of_leaves, num_of_proofs, flat_proof));
+    fmt.set_layout(LAYOUT_BLOCKED);
+    totals.push_back(time_proofs(PLATFORM + "_PROOFS_BLOCKED" + suffix,
+                                 num_of_leaves, num_of_proofs, flat_proof));
+    // every layout gives the same proofs
+    if (adjacent_find(totals.begin(), totals.end(),
+                      not_equal_to<size_t>()) != totals.end()) {
+      cerr << "the layouts gave different proofs" << endl;
+      exit(1);
+    }
+    cerr << num_of_proofs << " proofs of " << num_of_leaves << " leaves"
+         << endl;
+    return 0;
+  }
+
+  if (flat && cdc_avg_size > 0) {
+    // chunks of a quarter to 8 times the average size, as FastCDC suggests
+    options.content_defined = true;
+    options.chunking = {cdc_avg_size / 4, cdc_avg_size, cdc_avg_size * 8};
+    start_timer(config);
+    FlatMerkleTree fmt(data, data_len, hasher, options);
+    stop_timer();
+
+    cerr << "cdc (" << fastcdc_scanner_kernel() << "): "
+         << fmt.num_of_leaves() << " leaves of "
+         << data_len / max<size_t>(fmt.num_of_leaves(), 1)
+         << " bytes on average" << endl;
+    cerr << fmt.root_hash() << endl; // to stderr
+    print_timer_csv();
+    return 0;
+  }
+
+  if (flat) {
+    start_timer(config);
+    FlatMerkleTree fmt(data, data_len, hasher, options);
+    stop_timer();
+
+    if (arity > 0) {
+      cerr << "arity " << fmt.arity() << ", " << fmt.num_of_levels()
+           << " levels" << endl;
+    }
+    cerr << fmt.root_hash() << endl; // to stderr
+    print_timer_csv();
+    return 0;
+  }
+
+  unsigned long long allocations_before = num_of_allocations;
   start_timer(config);
-  MerkleTree mt(data, data_len, hasher);
+  MerkleTree mt(data, data_len, hasher, options);
   stop_timer();
 
+  if (allocs) {
+    cerr << "allocations: " << num_of_allocations - allocations_before
+         << ", node arena: " << mt.arena().num_of_slabs() << " slabs, "
+         << mt.arena().bytes() << " bytes" << endl;
+  }
+
   cerr << mt.root_hash() << endl; // to stderr
   print_timer_csv();
   return 0;
@@ -0,0 +1,234 @@
+#include "../merkle_tree.hpp"
+
+using namespace std;
+
+namespace {
+
+// the segment holding node index of a level, and the first node in it
+pair<size_t, size_t> segment_of(size_t index, size_t base) {
+  size_t segment = 63 - __builtin_clzll(index / base + 1);
+  return {segment, base * ((size_t(1) << segment) - 1)};
+}
+
+} // namespace
+
+//
+// Class ConcurrentMerkleTree
+//
+
+// The nodes [0, num_of_leaves >> level) of a level are full subtrees and are
+// stored in segments; the last node of the level, if it is past them, is on
+// the right edge and only in the snapshot.
+
+ConcurrentMerkleTree::ConcurrentMerkleTree(Hasher* hasher_)
+    : ConcurrentMerkleTree(hasher_, 1, BLOCK_SIZE) {}
+
+ConcurrentMerkleTree::ConcurrentMerkleTree(Hasher* hasher_,
+                                           unsigned int num_threads,
+                                           size_t block_size_)
+    : hasher(hasher_), digest_len(hasher_->hash_length()),
+      block_len(max<size_t>(block_size_, 1)), pool(max(num_threads, 1u)),
+      pair_buffer(hasher_->hash_length() * 2) {
+  publish(0);
+}
+
+ConcurrentMerkleTree::~ConcurrentMerkleTree() {
+  delete current.load();
+  for (Retired& r : retired) {
+    delete r.snapshot;
+  }
+}
+
+unsigned char* ConcurrentMerkleTree::node(size_t level, size_t index) const {
+  auto [segment, first] = segment_of(index, kSegmentBase);
+  return segments[level][segment].get() + (index - first) * digest_len;
+}
+
+// the place of a new full subtree, allocating its segment on first use
+unsigned char* ConcurrentMerkleTree::new_node(size_t level, size_t index) {
+  auto [segment, first] = segment_of(index, kSegmentBase);
+  if (!segments[level][segment]) {
+    segments[level][segment].reset(
+        new unsigned char[(kSegmentBase << segment) * digest_len]);
+  }
+  return segments[level][segment].get() + (index - first) * digest_len;
+}
+
+// hash the leaves into full subtrees level by level, then publish
+void ConcurrentMerkleTree::append_leaf_hashes(unsigned char* hashes,
+                                              size_t num_of_hashes) {
+  if (num_of_hashes == 0) {
+    return;
+  }
+  size_t old_leaves = current.load()->num_of_leaves;
+  size_t new_leaves = old_leaves + num_of_hashes;
+  for (size_t i = 0; i < num_of_hashes; i++) {
+    memcpy(new_node(0, old_leaves + i), hashes + i * digest_len, digest_len);
+  }
+  for (size_t level = 1; (new_leaves >> level) > 0; level++) {
+    size_t num_of_full = new_leaves >> level;
+    // the children of a run of parents in one segment are in one segment
+    // too, since segments start at even nodes, so a run is hashed in place
+    for (size_t first = old_leaves >> level; first < num_of_full;) {
+      auto [segment, segment_first] = segment_of(first, kSegmentBase);
+      auto [child_segment, child_first] =
+          segment_of(first * 2, kSegmentBase);
+      size_t segment_end = segment_first + (kSegmentBase << segment);
+      size_t child_segment_end =
+          child_first + (kSegmentBase << child_segment);
+      size_t last = min({num_of_full, segment_end, child_segment_end / 2});
+      unsigned char* children = node(level - 1, first * 2);
+      unsigned char* parents = new_node(level, first);
+      pool.parallel_for(last - first, [&](size_t begin, size_t end) {
+        hasher->get_hash(children + begin * digest_len * 2, digest_len * 2,
+                         parents + begin * digest_len, end - begin);
+      });
+      first = last;
+    }
+  }
+  publish(new_leaves);
+}
+
+void ConcurrentMerkleTree::append(unsigned char* data, size_t data_len) {
+  vector<unsigned char> hashes(num_of_blocks(data_len, block_len) *
+                               digest_len);
+  hash_blocks(data, data_len, block_len, hasher, hashes.data(), pool);
+  append_leaf_hashes(hashes.data(), hashes.size() / digest_len);
+}
+
+// work out the right edge of a tree of num_of_leaves leaves from the bottom
+// up, make it the current snapshot and retire the one it replaces
+void ConcurrentMerkleTree::publish(size_t num_of_leaves) {
+  Snapshot* snapshot = new Snapshot();
+  snapshot->num_of_leaves = num_of_leaves;
+  snapshot->num_of_levels = num_of_levels(num_of_leaves, 2);
+  snapshot->edges.resize(snapshot->num_of_levels * digest_len);
+  auto digest_at = [&](size_t level, size_t index) -> unsigned char* {
+    if (index < (num_of_leaves >> level)) {
+      return node(level, index);
+    }
+    return snapshot->edges.data() + level * digest_len;
+  };
+  for (size_t level = 1; level < snapshot->num_of_levels; level++) {
+    size_t index = num_of_leaves >> level;
+    if ((index << level) == num_of_leaves) {
+      continue;  // the level is all full subtrees
+    }
+    size_t child_size = ((num_of_leaves - 1) >> (level - 1)) + 1;
+    unsigned char* edge = snapshot->edges.data() + level * digest_len;
+    if (index * 2 + 1 < child_size) {
+      memcpy(pair_buffer.data(), digest_at(level - 1, index * 2), digest_len);
+      memcpy(pair_buffer.data() + digest_len,
+             digest_at(level - 1, index * 2 + 1), digest_len);
+      hasher->get_hash(pair_buffer.data(), digest_len * 2, edge);
+    } else {
+      // an orphan is carried up as it is
+      memcpy(edge, digest_at(level - 1, index * 2), digest_len);
+    }
+  }
+  if (num_of_leaves > 0) {
+    unsigned char* root = digest_at(snapshot->num_of_levels - 1, 0);
+    snapshot->root.assign(root, root + digest_len);
+  }
+
+  Snapshot* replaced = current.exchange(snapshot);
+  if (replaced != nullptr) {
+    retired.push_back({replaced, global_epoch.fetch_add(1)});
+  }
+  reclaim();
+}
+
+// free the retired snapshots no Reader can hold: one retired in epoch e was
+// current only before e ended, and a Reader that loaded it announced e or
+// earlier
+void ConcurrentMerkleTree::reclaim() {
+  uint64_t oldest = UINT64_MAX;
+  for (ReaderSlot& slot : slots) {
+    uint64_t epoch = slot.epoch.load();
+    if (epoch != 0) {
+      oldest = min(oldest, epoch);
+    }
+  }
+  size_t kept = 0;
+  for (Retired& r : retired) {
+    if (r.epoch < oldest) {
+      delete r.snapshot;
+    } else {
+      retired[kept++] = r;
+    }
+  }
+  retired.resize(kept);
+}
+
+size_t ConcurrentMerkleTree::block_size() const { return block_len; }
+
+size_t ConcurrentMerkleTree::num_of_retired() const { return retired.size(); }
+
+//
+// Class ConcurrentMerkleTree::Reader
+//
+
+// take a free slot, announcing the current epoch in it, and only then load
+// the snapshot
+ConcurrentMerkleTree::Reader::Reader(const ConcurrentMerkleTree& tree_)
+    : tree(&tree_), slot(nullptr) {
+  while (slot == nullptr) {
+    for (ReaderSlot& candidate : tree_.slots) {
+      uint64_t free = 0;
+      if (candidate.epoch.load() == 0 &&
+          candidate.epoch.compare_exchange_strong(
+              free, tree_.global_epoch.load())) {
+        slot = &candidate;
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      this_thread::yield();
+    }
+  }
+  snapshot = tree_.current.load();
+}
+
+ConcurrentMerkleTree::Reader::~Reader() { slot->epoch.store(0); }
+
+size_t ConcurrentMerkleTree::Reader::num_of_leaves() const {
+  return snapshot->num_of_leaves;
+}
+
+const vector<unsigned char>& ConcurrentMerkleTree::Reader::root() const {
+  return snapshot->root;
+}
+
+string ConcurrentMerkleTree::Reader::root_hash() const {
+  if (snapshot->root.empty()) {
+    return "";
+  }
+  return hash_to_hex_string((unsigned char*)snapshot->root.data(),
+                            tree->digest_len);
+}
+
+MerkleProof ConcurrentMerkleTree::Reader::find_proof(size_t leaf_index) const {
+  MerkleProof proof;
+  size_t num_of_leaves = snapshot->num_of_leaves;
+  if (leaf_index >= num_of_leaves) {
+    return proof;
+  }
+  unsigned int digest_len = tree->digest_len;
+  unsigned char* leaf = tree->node(0, leaf_index);
+  proof.leaf_hash.assign(leaf, leaf + digest_len);
+  size_t index = leaf_index;
+  for (size_t level = 0; level + 1 < snapshot->num_of_levels; level++) {
+    size_t sibling = index ^ 1;
+    if (sibling <= (num_of_leaves - 1) >> level) {
+      const unsigned char* hash =
+          sibling < (num_of_leaves >> level)
+              ? tree->node(level, sibling)
+              : snapshot->edges.data() + level * digest_len;
+      proof.sibling_hashes.insert(proof.sibling_hashes.end(), hash,
+                                  hash + digest_len);
+      proof.lrs.push_back(sibling < index ? LEFT : RIGHT);
+    }
+    index /= 2;
+  }
+  return proof;
+}
@@ -0,0 +1,284 @@
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <numeric>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../merkle_tree.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// O_DIRECT needs buffers, offsets and lengths aligned to the logical block
+// size of the device; 4096 covers the common ones
+const size_t kDirectIoAlignment = 4096;
+// how much larger than asked for the alignment of O_DIRECT may make a buffer
+const size_t kMaxBufferGrowth = 4;
+
+enum SlotState {
+  SLOT_FREE,     // waiting for the reader
+  SLOT_FILLED,   // waiting for a hash worker
+  SLOT_HASHING,  // taken by a hash worker
+  SLOT_HASHED    // waiting for the tree
+};
+
+struct Slot {
+  unsigned char* buffer = nullptr;
+  size_t len = 0;
+  unsigned long long seq = 0;
+  SlotState state = SLOT_FREE;
+  std::vector<unsigned char> hashes;
+};
+
+double seconds_since(steady_clock::time_point start) {
+  return duration<double>(steady_clock::now() - start).count();
+}
+
+// read len bytes into a buffer of buffer_size bytes, retrying short reads.
+// Every read asks for the rest of the buffer, which keeps the lengths aligned
+// for O_DIRECT even when len is not. Returns false on an error or early EOF.
+bool read_fully(int fd, unsigned char* buffer, size_t len,
+                size_t buffer_size) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, buffer + done, buffer_size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+} // namespace
+
+//
+// struct PipelineStats
+//
+void PipelineStats::print(ostream& out) {
+  double mb = bytes / 1e6;
+  out << "bytes = " << bytes << (direct_io ? " (O_DIRECT)" : "") << endl;
+  out << "total: " << mb / total_seconds << " MB/s" << endl;
+  out << "read:  " << mb / read_seconds << " MB/s, waited "
+       << reader_wait_seconds << " s for buffers" << endl;
+  out << "hash:  " << mb / hash_seconds << " MB/s per worker, waited "
+       << hash_wait_seconds << " s for data" << endl;
+  out << (reader_wait_seconds > hash_wait_seconds ? "CPU-bound" : "I/O-bound")
+       << endl;
+}
+
+//
+// Class FileHashPipeline
+//
+FileHashPipeline::FileHashPipeline(Hasher* hasher_, unsigned int num_workers_,
+                                   unsigned int queue_depth_,
+                                   size_t buffer_size_, bool direct_io_)
+    : FileHashPipeline(hasher_, num_workers_, queue_depth_, buffer_size_,
+                       direct_io_, BLOCK_SIZE) {}
+
+FileHashPipeline::FileHashPipeline(Hasher* hasher_, unsigned int num_workers_,
+                                   unsigned int queue_depth_,
+                                   size_t buffer_size_, bool direct_io_,
+                                   size_t block_size_)
+    : hasher(hasher_), num_workers(max(num_workers_, 1u)),
+      queue_depth(max(queue_depth_, 1u)), direct_io(direct_io_),
+      block_len(max<size_t>(block_size_, 1)) {
+  // a buffer holds whole blocks, so leaves never straddle two buffers, and
+  // for O_DIRECT a whole number of aligned units too. Where that would make
+  // a buffer much larger than asked for, e.g. for a block size that is not a
+  // multiple of a power of two, the file is read buffered instead.
+  size_t requested = max(buffer_size_, block_len);
+  size_t unit = block_len;
+  if (direct_io) {
+    size_t direct_unit = lcm(block_len, kDirectIoAlignment);
+    if (direct_unit <= requested * kMaxBufferGrowth) {
+      unit = direct_unit;
+    } else {
+      direct_io = false;
+    }
+  }
+  buffer_size = max<size_t>(buffer_size_ / unit, 1) * unit;
+}
+
+bool FileHashPipeline::run(string path, StreamingMerkleTree& tree) {
+  stats = PipelineStats();
+  // adding no leaves tells whether the tree is at a block boundary
+  if (tree.block_size() != block_len || !tree.add_leaf_hashes(nullptr, 0)) {
+    return false;
+  }
+  int fd = -1;
+#ifdef O_DIRECT
+  if (direct_io) {
+    fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    stats.direct_io = fd >= 0;
+  }
+#endif
+  if (fd < 0) {
+    fd = open(path.c_str(), O_RDONLY);
+  }
+  if (fd < 0) {
+    cerr << "Error opening " << path << ": " << strerror(errno) << endl;
+    return false;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cerr << "Error reading the size of " << path << ": " << strerror(errno)
+         << endl;
+    close(fd);
+    return false;
+  }
+  size_t file_size = st.st_size;
+  unsigned long long num_of_chunks = (file_size + buffer_size - 1) / buffer_size;
+
+  unsigned int digest_len = hasher->hash_length();
+  vector<Slot> slots(queue_depth);
+  for (auto& slot : slots) {
+    if (posix_memalign((void**)&slot.buffer, kDirectIoAlignment,
+                       buffer_size) != 0) {
+      slot.buffer = nullptr;
+    }
+    slot.hashes.resize(buffer_size / block_len * digest_len);
+  }
+  bool failed = any_of(slots.begin(), slots.end(),
+                       [](const Slot& slot) { return slot.buffer == nullptr; });
+
+  mutex mtx;
+  condition_variable reader_cv;   // a slot was freed
+  condition_variable worker_cv;   // a slot was filled
+  condition_variable tree_cv;     // a slot was hashed
+  unsigned long long chunks_taken = 0;
+  auto start = steady_clock::now();
+
+  // reader: fill the slots in file order, chunk seq into slot seq % depth
+  thread reader([&]() {
+    for (unsigned long long seq = 0; seq < num_of_chunks; seq++) {
+      Slot& slot = slots[seq % queue_depth];
+      {
+        auto wait_start = steady_clock::now();
+        unique_lock<mutex> lock(mtx);
+        reader_cv.wait(lock, [&]() {
+          return slot.state == SLOT_FREE || failed;
+        });
+        stats.reader_wait_seconds += seconds_since(wait_start);
+        if (failed) {
+          break;
+        }
+      }
+      size_t len = min<size_t>(buffer_size, file_size - seq * buffer_size);
+      auto read_start = steady_clock::now();
+      bool read_ok = read_fully(fd, slot.buffer, len, buffer_size);
+      double read_seconds = seconds_since(read_start);
+      lock_guard<mutex> lock(mtx);
+      stats.read_seconds += read_seconds;
+      if (!read_ok) {
+        cerr << "Error reading " << path << endl;
+        failed = true;
+        worker_cv.notify_all();
+        tree_cv.notify_all();
+        break;
+      }
+      slot.len = len;
+      slot.seq = seq;
+      slot.state = SLOT_FILLED;
+      stats.bytes += len;
+      worker_cv.notify_one();
+    }
+  });
+
+  // hash workers: hash the full blocks of any filled slot; the tail of the
+  // file goes to the tree as data, so it stays a partial block there
+  vector<thread> workers;
+  for (unsigned int i = 0; i < num_workers; i++) {
+    workers.emplace_back([&]() {
+      ThreadPool serial(1);
+      while (true) {
+        Slot* slot = nullptr;
+        {
+          auto wait_start = steady_clock::now();
+          unique_lock<mutex> lock(mtx);
+          auto filled = [&]() {
+            for (auto& s : slots) {
+              if (s.state == SLOT_FILLED) {
+                return &s;
+              }
+            }
+            return (Slot*)nullptr;
+          };
+          // done once every chunk of the file has been taken
+          worker_cv.wait(lock, [&]() {
+            return filled() != nullptr || chunks_taken == num_of_chunks ||
+                   failed;
+          });
+          stats.hash_wait_seconds += seconds_since(wait_start);
+          slot = failed ? nullptr : filled();
+          if (slot == nullptr) {
+            return;
+          }
+          slot->state = SLOT_HASHING;
+          if (++chunks_taken == num_of_chunks) {
+            worker_cv.notify_all();
+          }
+        }
+        auto hash_start = steady_clock::now();
+        size_t full_len = slot->len / block_len * block_len;
+        hash_blocks(slot->buffer, full_len, block_len, hasher,
+                    slot->hashes.data(), serial);
+        double hash_seconds = seconds_since(hash_start);
+        lock_guard<mutex> lock(mtx);
+        stats.hash_seconds += hash_seconds;
+        slot->state = SLOT_HASHED;
+        tree_cv.notify_all();
+      }
+    });
+  }
+
+  // this thread: feed the hashed slots to the tree in file order
+  for (unsigned long long seq = 0;; seq++) {
+    Slot& slot = slots[seq % queue_depth];
+    {
+      unique_lock<mutex> lock(mtx);
+      if (seq == num_of_chunks) {
+        break;
+      }
+      tree_cv.wait(lock, [&]() {
+        return (slot.state == SLOT_HASHED && slot.seq == seq) || failed;
+      });
+      if (failed) {
+        break;
+      }
+    }
+    size_t num_of_full_blocks = slot.len / block_len;
+    tree.add_leaf_hashes(slot.hashes.data(), num_of_full_blocks);
+    tree.update(slot.buffer + num_of_full_blocks * block_len,
+                slot.len - num_of_full_blocks * block_len);
+    lock_guard<mutex> lock(mtx);
+    slot.state = SLOT_FREE;
+    reader_cv.notify_one();
+  }
+  {
+    lock_guard<mutex> lock(mtx);
+    if (failed) {
+      reader_cv.notify_all();
+      worker_cv.notify_all();
+    }
+  }
+  reader.join();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  close(fd);
+  for (auto& slot : slots) {
+    free(slot.buffer);
+  }
+  stats.total_seconds = seconds_since(start);
+  return !failed;
+}
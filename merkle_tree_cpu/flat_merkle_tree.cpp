@@ -0,0 +1,487 @@
+#include <algorithm>
+#include <cassert>
+#include "../merkle_tree.hpp"
+
+using namespace std;
+
+namespace {
+
+// bytes of a block of LAYOUT_BLOCKED at most, a page
+const size_t kLayoutBlockBytes = 4096;
+
+// chunking clamped to 1 <= min_size <= avg_size <= max_size, as the chunker
+// does, so a saved tree records the sizes its leaves were cut with
+ChunkingParams clamp_chunking(ChunkingParams chunking) {
+  chunking.max_size = max<size_t>(chunking.max_size, 1);
+  chunking.min_size = max<size_t>(min(chunking.min_size, chunking.max_size),
+                                  1);
+  chunking.avg_size = min(max(chunking.avg_size, chunking.min_size),
+                          chunking.max_size);
+  return chunking;
+}
+
+} // namespace
+
+//
+// Class FlatMerkleTree
+//
+
+// lay out the levels for num_of_leaves leaves; returns the number of nodes
+size_t FlatMerkleTree::layout_levels(size_t num_of_leaves) {
+  level_offsets.clear();
+  size_t offset = 0;
+  size_t size = num_of_leaves;
+  while (size > 0) {
+    level_offsets.push_back(offset);
+    offset += size;
+    if (size == 1) {
+      break;
+    }
+    size = (size + branching_factor - 1) / branching_factor;
+  }
+  level_offsets.push_back(offset);
+  return offset;
+}
+
+// work out where each level sits in LAYOUT_BLOCKED. The root comes first on
+// its own; below it, bands of up to h levels are cut from the top, and each
+// node of the level above a band anchors a block of its children and their
+// descendants down to the bottom of the band, stored level by level. The
+// blocks of a band are in the order of their anchors, and all but the last
+// are full.
+void FlatMerkleTree::layout_blocks() {
+  size_t k = branching_factor;
+  // the most levels whose full block fits in kLayoutBlockBytes
+  size_t h = 1;
+  for (size_t nodes = k, span = k * k;
+       (nodes + span) * digest_len <= kLayoutBlockBytes; span *= k) {
+    nodes += span;
+    h++;
+  }
+  blocked_levels.assign(num_of_levels(), BlockedLevel());
+  if (num_of_levels() == 0) {
+    return;
+  }
+  size_t top = num_of_levels() - 1;
+  blocked_levels[top] = {0, 1, 1, 0, 0, 0, 0};
+  size_t base = 1;
+  for (size_t anchor = top; anchor > 0;) {
+    size_t bottom = anchor - min(h, anchor);
+    size_t last_block = level_size(anchor) - 1;
+    size_t span = 1;
+    size_t prefix = 0;
+    size_t last_prefix = 0;
+    for (size_t level = anchor; level-- > bottom;) {
+      span *= k;
+      BlockedLevel& b = blocked_levels[level];
+      b.base = base;
+      b.span = span;
+      b.prefix = prefix;
+      b.span_shift = (span & (span - 1)) == 0 ? __builtin_ctzll(span) : -1;
+      b.last_block = last_block;
+      b.last_prefix = last_prefix;
+      prefix += span;
+      last_prefix += level_size(level) - last_block * span;
+    }
+    for (size_t level = bottom; level < anchor; level++) {
+      blocked_levels[level].block_nodes = prefix;
+      base += level_size(level);
+    }
+    anchor = bottom;
+  }
+}
+
+// index of node index of level among all nodes in layout
+size_t FlatMerkleTree::node_offset(NodeLayout layout, size_t level,
+                                   size_t index) const {
+  if (layout == LAYOUT_LEVEL_ORDER) {
+    return level_offsets[level] + index;
+  }
+  const BlockedLevel& b = blocked_levels[level];
+  size_t block = b.span_shift >= 0 ? index >> b.span_shift : index / b.span;
+  return b.base + block * b.block_nodes +
+         (block == b.last_block ? b.last_prefix : b.prefix) +
+         index - block * b.span;
+}
+
+// lay out the levels for num_of_leaves leaves and allocate all nodes at once
+void FlatMerkleTree::make_levels(size_t num_of_leaves) {
+  tree_file.reset();
+  node_layout = LAYOUT_LEVEL_ORDER;
+  blocked_levels.clear();
+  nodes.assign(layout_levels(num_of_leaves) * digest_len, 0);
+  sorted_leaves.clear();
+  chunk_ends.clear();
+}
+
+// hash data straight into the leaves and reduce them level by level. If data
+// is the mapping of file, its pages are released once hashed.
+void FlatMerkleTree::make_tree_from_data(unsigned char* data, size_t data_len,
+                                         MappedFile* file) {
+  vector<size_t> ends;
+  if (content_defined) {
+    ends = find_chunk_ends(data, data_len, chunking);
+  }
+  size_t num_of_leaves = content_defined ? ends.size()
+                                         : num_of_blocks(data_len, block_len);
+  make_levels(num_of_leaves);
+  if (num_of_leaves == 0) {
+    return;
+  }
+  ThreadPool pool(num_threads);
+  if (content_defined) {
+    chunk_ends.swap(ends);
+    hash_chunks(data, chunk_ends, hasher, node_hash(0, 0), pool);
+    if (file != nullptr) {
+      file->release(0, data_len);
+    }
+  } else if (file != nullptr) {
+    hash_blocks(*file, block_len, hasher, node_hash(0, 0), pool);
+  } else {
+    hash_blocks(data, data_len, block_len, hasher, node_hash(0, 0), pool);
+  }
+  sorted_leaves.resize(num_of_leaves);
+  for (size_t i = 0; i < num_of_leaves; i++) {
+    sorted_leaves[i] = i;
+  }
+  sort(sorted_leaves.begin(), sorted_leaves.end(), [this](size_t a, size_t b) {
+    return memcmp(node_hash(0, a), node_hash(0, b), digest_len) < 0;
+  });
+
+  size_t k = branching_factor;
+  for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+    size_t size = level_size(level);
+    // siblings are adjacent in the buffer, so the groups are hashed in place,
+    // a whole range of them per call
+    pool.parallel_for(size / k, [&](size_t begin, size_t end) {
+      hasher->get_hash(node_hash(level, begin * k), digest_len * k,
+                       node_hash(level + 1, begin), end - begin);
+    });
+    // hash the last, smaller group, or carry the orphan node to the next
+    // level
+    size_t rest = size % k;
+    if (rest == 1) {
+      memcpy(node_hash(level + 1, size / k), node_hash(level, size - 1),
+             digest_len);
+    } else if (rest > 1) {
+      hasher->get_hash(node_hash(level, size - rest), digest_len * rest,
+                       node_hash(level + 1, size / k));
+    }
+  }
+}
+
+// the first child of the group of the node at index of level, and the
+// number of children in the group
+pair<size_t, size_t> FlatMerkleTree::group_of(size_t level, size_t index) {
+  size_t first = index / branching_factor * branching_factor;
+  return {first, min<size_t>(branching_factor, level_size(level) - first)};
+}
+
+// start loading the group of every level on the path from a leaf to the
+// root. Where they are is known up front, so the loads overlap instead of
+// each level waiting for the one below.
+void FlatMerkleTree::prefetch_path(size_t leaf_index) {
+  size_t index = leaf_index;
+  for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+    size_t first = index / branching_factor * branching_factor;
+    const unsigned char* group = node_hash(level, first);
+    size_t group_end =
+        min<size_t>(branching_factor, level_size(level) - first) * digest_len;
+    for (size_t offset = 0; offset < group_end; offset += 64) {
+      __builtin_prefetch(group + offset);
+    }
+    __builtin_prefetch(group + group_end - 1);
+    index /= branching_factor;
+  }
+}
+
+// walk up from a leaf with its siblings and compare with the root
+bool FlatMerkleTree::verify(size_t leaf_index) {
+  vector<unsigned char> cur(node_hash(0, leaf_index),
+                            node_hash(0, leaf_index) + digest_len);
+  vector<unsigned char> data;
+  size_t index = leaf_index;
+  for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+    auto [first, group_size] = group_of(level, index);
+    if (group_size > 1) {
+      data.assign(node_hash(level, first),
+                  node_hash(level, first) + group_size * digest_len);
+      memcpy(data.data() + (index - first) * digest_len, cur.data(),
+             digest_len);
+      hasher->get_hash(data.data(), group_size * digest_len, cur.data());
+    }
+    index /= branching_factor;
+  }
+  return memcmp(cur.data(), node_hash(num_of_levels() - 1, 0),
+                digest_len) == 0;
+}
+
+// print a FlatMerkleTree, layer by layer, left to right, in the same order as
+// MerkleTree::print(). A copied orphan is printed once, where it is a child.
+void FlatMerkleTree::print() {
+  if (num_of_leaves() == 0) {
+    return;
+  }
+  // step down from a copied orphan to the node it was copied from
+  size_t k = branching_factor;
+  auto original = [this, k](pair<size_t, size_t> node) {
+    while (node.first > 0 && node.second * k + 1 >= level_size(node.first - 1)) {
+      node = {node.first - 1, node.second * k};
+    }
+    return node;
+  };
+  queue<pair<size_t, size_t>> q;
+  q.push(original({num_of_levels() - 1, 0}));
+  int layer = 0;
+  while (!q.empty()) {
+    cout << "Layer " << layer << ":" << endl;
+    int size = q.size();
+    while (size > 0) {
+      auto [level, index] = q.front();
+      q.pop();
+      cout << hash_to_hex_string(node_hash(level, index), digest_len) << endl;
+      if (level > 0) {
+        auto [first, group_size] = group_of(level - 1, index * k);
+        for (size_t child = first; child < first + group_size; child++) {
+          q.push(original({level - 1, child}));
+        }
+      }
+      size--;
+    }
+    layer++;
+  }
+}
+
+// return a string contains the root hash in hex string format
+string FlatMerkleTree::root_hash() {
+  if (num_of_leaves() == 0) {
+    return "";
+  }
+  return hash_to_hex_string(node_hash(num_of_levels() - 1, 0), digest_len);
+}
+
+// print the root hash in hex string format
+void FlatMerkleTree::print_root_hash() { cout << root_hash() << endl; }
+
+// constructor with only Hasher
+FlatMerkleTree::FlatMerkleTree(Hasher* hasher_)
+    : hasher(hasher_), digest_len(hasher_->hash_length()) {
+  make_levels(0);
+}
+
+// constructor using data in unsigned char and data_len, with the threads,
+// arity and leaves of options
+FlatMerkleTree::FlatMerkleTree(unsigned char* data, int data_len,
+                               Hasher* hasher_, const TreeOptions& options)
+    : hasher(hasher_), digest_len(hasher_->hash_length()),
+      num_threads(max(options.num_threads, 1u)),
+      branching_factor(max(options.arity, 2u)),
+      block_len(max<size_t>(options.block_size, 1)),
+      content_defined(options.content_defined),
+      chunking(clamp_chunking(options.chunking)) {
+  make_tree_from_data(data, data_len);
+}
+
+// constructor hashing a file straight from its mapping in memory
+FlatMerkleTree::FlatMerkleTree(string path, Hasher* hasher_,
+                               const TreeOptions& options)
+    : hasher(hasher_), digest_len(hasher_->hash_length()),
+      num_threads(max(options.num_threads, 1u)),
+      branching_factor(max(options.arity, 2u)),
+      block_len(max<size_t>(options.block_size, 1)),
+      content_defined(options.content_defined),
+      chunking(clamp_chunking(options.chunking)) {
+  MappedFile file(path);
+  if (file.is_open()) {
+    make_tree_from_data(file.data(), file.size(), &file);
+  } else {
+    make_levels(0);
+  }
+}
+
+unsigned int FlatMerkleTree::arity() const { return branching_factor; }
+
+size_t FlatMerkleTree::block_size() const { return block_len; }
+
+// move every node to its place in layout, a run of the nodes of a level that
+// are adjacent in both layouts at a time
+bool FlatMerkleTree::set_layout(NodeLayout layout) {
+  if (tree_file) {
+    return false;
+  }
+  if (layout == node_layout) {
+    return true;
+  }
+  if (blocked_levels.size() != num_of_levels()) {
+    layout_blocks();
+  }
+  vector<unsigned char> moved(nodes.size());
+  for (size_t level = 0; level < num_of_levels(); level++) {
+    size_t span = blocked_levels[level].span;
+    for (size_t index = 0; index < level_size(level); index += span) {
+      size_t run = min(span, level_size(level) - index);
+      memcpy(moved.data() + node_offset(layout, level, index) * digest_len,
+             node_hash(level, index), run * digest_len);
+    }
+  }
+  nodes.swap(moved);
+  node_layout = layout;
+  return true;
+}
+
+NodeLayout FlatMerkleTree::layout() const { return node_layout; }
+
+const ChunkingParams* FlatMerkleTree::chunking_params() const {
+  return content_defined ? &chunking : nullptr;
+}
+
+pair<size_t, size_t> FlatMerkleTree::leaf_range(size_t leaf_index) {
+  if (leaf_index >= num_of_leaves()) {
+    return {0, 0};
+  }
+  if (!content_defined) {
+    return {leaf_index * block_len, (leaf_index + 1) * block_len};
+  }
+  const size_t* ends = leaf_ends();
+  return {leaf_index == 0 ? 0 : ends[leaf_index - 1], ends[leaf_index]};
+}
+
+size_t FlatMerkleTree::leaf_at(size_t offset) {
+  if (!content_defined) {
+    return min(offset / block_len, num_of_leaves());
+  }
+  // the first leaf ending after offset
+  const size_t* ends = leaf_ends();
+  return upper_bound(ends, ends + num_of_leaves(), offset) - ends;
+}
+
+size_t FlatMerkleTree::num_of_leaves() const { return level_size(0); }
+
+size_t FlatMerkleTree::num_of_levels() const {
+  return level_offsets.size() - 1;
+}
+
+size_t FlatMerkleTree::level_size(size_t level) const {
+  if (level >= num_of_levels()) {
+    return 0;
+  }
+  return level_offsets[level + 1] - level_offsets[level];
+}
+
+unsigned char* FlatMerkleTree::node_hash(size_t level, size_t index) {
+  unsigned char* base = tree_file ? tree_file->data() + saved_nodes_offset
+                                  : nodes.data();
+  return base + node_offset(node_layout, level, index) * digest_len;
+}
+
+// leaf indices sorted by their digests
+const size_t* FlatMerkleTree::leaf_order() {
+  if (tree_file) {
+    return (const size_t*)(tree_file->data() + saved_leaves_offset);
+  }
+  return sorted_leaves.data();
+}
+
+// the end offset of each leaf in the data, for content-defined leaves
+const size_t* FlatMerkleTree::leaf_ends() {
+  if (tree_file) {
+    return content_defined
+               ? (const size_t*)(tree_file->data() + saved_chunk_ends_offset)
+               : nullptr;
+  }
+  return chunk_ends.data();
+}
+
+// binary search for a leaf by its hash
+size_t FlatMerkleTree::find_leaf(unsigned char* hash) {
+  const size_t* order = leaf_order();
+  const size_t* order_end = order + num_of_leaves();
+  auto it = lower_bound(order, order_end, hash,
+                        [this](size_t leaf, unsigned char* key) {
+                          return memcmp(node_hash(0, leaf), key,
+                                        digest_len) < 0;
+                        });
+  if (it == order_end ||
+      memcmp(node_hash(0, *it), hash, digest_len) != 0) {
+    return num_of_leaves();
+  }
+  return *it;
+}
+
+size_t FlatMerkleTree::find_leaf(string hash_str) {
+  if (hash_str.size() != digest_len * 2) {
+    return num_of_leaves();
+  }
+  vector<unsigned char> hash(digest_len);
+  hex_string_to_hash(hash_str, hash.data(), digest_len);
+  return find_leaf(hash.data());
+}
+
+// return the sibling MerkleNodes of a leaf along the path to the root
+vector<MerkleNode> FlatMerkleTree::find_siblings(size_t leaf_index) {
+  vector<MerkleNode> result;
+  if (leaf_index >= num_of_leaves() || branching_factor != 2) {
+    return result;
+  }
+  size_t index = leaf_index;
+  for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+    size_t sibling = index ^ 1;
+    if (sibling < level_size(level)) {
+      MerkleNode tmp;
+      tmp.hash = node_hash(level, sibling);
+      tmp.digest_len = digest_len;
+      tmp.lr = (sibling < index) ? LEFT : RIGHT;
+      result.push_back(tmp);
+    }
+    index /= 2;
+  }
+  return result;
+}
+
+// return the sibling MerkleNodes along the path to the root.
+vector<MerkleNode> FlatMerkleTree::find_siblings(string hash_str) {
+  return find_siblings(find_leaf(hash_str));
+}
+
+// verify whether a piece of data exists in the FlatMerkleTree
+bool FlatMerkleTree::verify(unsigned char *data, int data_len) {
+  ThreadPool pool(num_threads);
+  vector<unsigned char> hashes_to_verify;
+  if (content_defined) {
+    vector<size_t> ends = find_chunk_ends(data, data_len, chunking);
+    hashes_to_verify.resize(ends.size() * digest_len);
+    hash_chunks(data, ends, hasher, hashes_to_verify.data(), pool);
+  } else {
+    hashes_to_verify.resize(num_of_blocks(data_len, block_len) * digest_len);
+    hash_blocks(data, data_len, block_len, hasher, hashes_to_verify.data(),
+                pool);
+  }
+  for (size_t i = 0; i < hashes_to_verify.size(); i += digest_len) {
+    if (!verify(hashes_to_verify.data() + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// verify whether a block of data exists in the FlatMerkleTree
+bool FlatMerkleTree::verify(Block &block) {
+  vector<unsigned char> hash(digest_len);
+  hasher->get_hash(block.data, block.size, hash.data());
+  return verify(hash.data());
+}
+
+// verify whether a hash_str of some data exists in the FlatMerkleTree
+bool FlatMerkleTree::verify(string hash_str) {
+  size_t leaf_index = find_leaf(hash_str);
+  if (leaf_index == num_of_leaves()) {
+    return false;
+  }
+  return verify(leaf_index);
+}
+
+// verify whether the raw digest of some data exists in the FlatMerkleTree
+bool FlatMerkleTree::verify(unsigned char* hash) {
+  size_t leaf_index = find_leaf(hash);
+  return leaf_index != num_of_leaves() && verify(leaf_index);
+}
@@ -0,0 +1,457 @@
+#include <algorithm>
+#include "../merkle_tree.hpp"
+
+using namespace std;
+
+namespace {
+
+// make the multiproof of leaf_indices for a tree of num_of_leaves leaves;
+// node_hash(level, index) returns the digest of a node of the tree. Walks up
+// level by level with the indices of the nodes the verifier will know, and
+// takes the sibling of each one unless the verifier knows it too.
+template <typename NodeHash>
+MerkleMultiProof make_multiproof(size_t num_of_leaves,
+                                 vector<size_t> leaf_indices,
+                                 unsigned int digest_len, NodeHash node_hash) {
+  MerkleMultiProof proof;
+  sort(leaf_indices.begin(), leaf_indices.end());
+  leaf_indices.erase(unique(leaf_indices.begin(), leaf_indices.end()),
+                     leaf_indices.end());
+  if (leaf_indices.empty() || leaf_indices.back() >= num_of_leaves) {
+    return proof;
+  }
+  proof.num_of_leaves = num_of_leaves;
+  proof.leaf_indices = leaf_indices;
+  vector<size_t>& known = leaf_indices;
+  size_t size = num_of_leaves;
+  for (size_t level = 0; size > 1; level++) {
+    for (size_t k = 0; k < known.size(); k++) {
+      size_t sibling = known[k] ^ 1;
+      if (sibling >= size) {
+        continue;  // an orphan is carried up as it is
+      }
+      if (k + 1 < known.size() && known[k + 1] == sibling) {
+        k++;  // both children are known
+        continue;
+      }
+      unsigned char* hash = node_hash(level, sibling);
+      proof.hashes.insert(proof.hashes.end(), hash, hash + digest_len);
+    }
+    for (auto& index : known) {
+      index /= 2;
+    }
+    known.erase(unique(known.begin(), known.end()), known.end());
+    size = (size + 1) / 2;
+  }
+  return proof;
+}
+
+// make the range proof of the leaves [first, last) of a tree of
+// num_of_leaves leaves and arity children per parent; node_hash(level,
+// index) returns the digest of a node of the tree
+template <typename NodeHash>
+MerkleRangeProof make_range_proof(size_t num_of_leaves, unsigned int arity,
+                                  size_t first, size_t last,
+                                  unsigned int digest_len,
+                                  NodeHash node_hash) {
+  MerkleRangeProof proof;
+  if (first >= last || last > num_of_leaves) {
+    return proof;
+  }
+  proof.num_of_leaves = num_of_leaves;
+  proof.arity = arity;
+  proof.first = first;
+  proof.last = last;
+  size_t size = num_of_leaves;
+  for (size_t level = 0; size > 1; level++) {
+    size_t group_begin = first / arity * arity;
+    size_t group_end = min((last + arity - 1) / arity * arity, size);
+    for (size_t index = group_begin; index < first; index++) {
+      unsigned char* hash = node_hash(level, index);
+      proof.hashes.insert(proof.hashes.end(), hash, hash + digest_len);
+    }
+    for (size_t index = last; index < group_end; index++) {
+      unsigned char* hash = node_hash(level, index);
+      proof.hashes.insert(proof.hashes.end(), hash, hash + digest_len);
+    }
+    first /= arity;
+    last = (last + arity - 1) / arity;
+    size = (size + arity - 1) / arity;
+  }
+  return proof;
+}
+
+// pairs a thread of verify_proofs() remembers before it starts over
+const size_t kMaxHashedPairs = 1 << 20;
+
+} // namespace
+
+// verify many proofs against one root, all in raw digests. Every proof is
+// hashed all the way up to the root, but each thread remembers the parents
+// it has hashed by the pair of children they were hashed from, so the pairs
+// that proofs of nearby leaves share are hashed once; sorting the proofs by
+// leaf saves most of the hashing. Returns whether each proof is valid.
+vector<bool> verify_proofs(vector<MerkleProof>& proofs,
+                           unsigned char* root_hash, Hasher* hasher,
+                           ThreadPool& pool) {
+  unsigned int digest_len = hasher->hash_length();
+  vector<char> results(proofs.size(), false);
+  pool.parallel_for(proofs.size(), [&](size_t begin, size_t end) {
+    // scratch shared by all proofs of this range: the index in parents of
+    // the parent of each pair of children hashed so far
+    DigestMap hashed(digest_len * 2);
+    vector<unsigned char> parents;
+    vector<unsigned char> cur(digest_len);
+    vector<unsigned char> data(digest_len * 2);
+    for (size_t i = begin; i < end; i++) {
+      const MerkleProof& proof = proofs[i];
+      size_t num_of_siblings = proof.lrs.size();
+      if (proof.leaf_hash.size() != digest_len ||
+          proof.sibling_hashes.size() != num_of_siblings * digest_len) {
+        continue;
+      }
+      if (hashed.size() >= kMaxHashedPairs) {
+        hashed.reset(digest_len * 2);
+        parents.clear();
+      }
+      memcpy(cur.data(), proof.leaf_hash.data(), digest_len);
+      for (size_t j = 0; j < num_of_siblings; j++) {
+        const unsigned char* sibling = proof.sibling_hashes.data() +
+                                       j * digest_len;
+        if (proof.lrs[j] == LEFT) {
+          memcpy(data.data(), sibling, digest_len);
+          memcpy(data.data() + digest_len, cur.data(), digest_len);
+        } else {
+          memcpy(data.data(), cur.data(), digest_len);
+          memcpy(data.data() + digest_len, sibling, digest_len);
+        }
+        size_t parent = hashed.find(data.data());
+        if (parent == DigestMap::npos) {
+          hasher->get_hash(data.data(), digest_len * 2, cur.data());
+          hashed.insert(data.data(), parents.size() / digest_len);
+          parents.insert(parents.end(), cur.begin(), cur.end());
+        } else {
+          memcpy(cur.data(), parents.data() + parent * digest_len,
+                 digest_len);
+        }
+      }
+      results[i] = memcmp(cur.data(), root_hash, digest_len) == 0;
+    }
+  });
+  return vector<bool>(results.begin(), results.end());
+}
+
+// verify a multiproof given the digests of its leaves, back to back in the
+// order of proof.leaf_indices. The parents of each level are hashed in one
+// batch. Returns false if the proof does not have exactly the digests its
+// layout needs.
+bool verify_multiproof(MerkleMultiProof& proof, unsigned char* leaf_hashes,
+                       unsigned char* root_hash, Hasher* hasher) {
+  unsigned int digest_len = hasher->hash_length();
+  vector<size_t> known = proof.leaf_indices;
+  if (known.empty() || !is_sorted(known.begin(), known.end()) ||
+      adjacent_find(known.begin(), known.end()) != known.end() ||
+      known.back() >= proof.num_of_leaves) {
+    return false;
+  }
+  vector<unsigned char> cur(leaf_hashes,
+                            leaf_hashes + known.size() * digest_len);
+  vector<unsigned char> pairs;
+  size_t num_of_proof_hashes = proof.hashes.size() / digest_len;
+  size_t next_proof_hash = 0;
+  // the next proof digest, or nullptr if there are no more
+  auto take_proof_hash = [&]() -> const unsigned char* {
+    if (next_proof_hash == num_of_proof_hashes) {
+      return nullptr;
+    }
+    return proof.hashes.data() + digest_len * next_proof_hash++;
+  };
+  size_t size = proof.num_of_leaves;
+  while (size > 1) {
+    pairs.clear();
+    bool has_orphan = false;
+    for (size_t k = 0; k < known.size(); k++) {
+      const unsigned char* node = cur.data() + k * digest_len;
+      const unsigned char* lhs = node;
+      const unsigned char* rhs = node;
+      if ((known[k] ^ 1) >= size) {
+        has_orphan = true;  // the last one, since known is sorted
+        continue;
+      }
+      if (known[k] % 2 == 0) {
+        if (k + 1 < known.size() && known[k + 1] == known[k] + 1) {
+          rhs = cur.data() + ++k * digest_len;
+        } else {
+          rhs = take_proof_hash();
+        }
+      } else {
+        lhs = take_proof_hash();
+      }
+      if (lhs == nullptr || rhs == nullptr) {
+        return false;
+      }
+      pairs.insert(pairs.end(), lhs, lhs + digest_len);
+      pairs.insert(pairs.end(), rhs, rhs + digest_len);
+    }
+    size_t num_of_pairs = pairs.size() / (digest_len * 2);
+    vector<unsigned char> next((num_of_pairs + has_orphan) * digest_len);
+    hasher->get_hash(pairs.data(), digest_len * 2, next.data(), num_of_pairs);
+    if (has_orphan) {
+      memcpy(next.data() + num_of_pairs * digest_len,
+             cur.data() + cur.size() - digest_len, digest_len);
+    }
+    cur.swap(next);
+    for (auto& index : known) {
+      index /= 2;
+    }
+    known.erase(unique(known.begin(), known.end()), known.end());
+    size = (size + 1) / 2;
+  }
+  return next_proof_hash == num_of_proof_hashes &&
+         proof.hashes.size() % digest_len == 0 &&
+         memcmp(cur.data(), root_hash, digest_len) == 0;
+}
+
+// verify a proof of a leaf of a tree of any arity against root_hash,
+// rebuilding each group with the path's node in its place. Returns false if
+// the proof does not have exactly the digests its groups need.
+bool verify_kary_proof(const KaryMerkleProof& proof, unsigned char* root_hash,
+                       Hasher* hasher) {
+  unsigned int digest_len = hasher->hash_length();
+  size_t num_of_levels = proof.group_sizes.size();
+  if (proof.leaf_hash.size() != digest_len ||
+      proof.positions.size() != num_of_levels) {
+    return false;
+  }
+  size_t num_of_siblings = 0;
+  for (size_t i = 0; i < num_of_levels; i++) {
+    if (proof.group_sizes[i] < 2 ||
+        proof.positions[i] >= proof.group_sizes[i]) {
+      return false;
+    }
+    num_of_siblings += proof.group_sizes[i] - 1;
+  }
+  if (proof.sibling_hashes.size() != num_of_siblings * digest_len) {
+    return false;
+  }
+  vector<unsigned char> cur(proof.leaf_hash);
+  vector<unsigned char> group;
+  const unsigned char* sibling = proof.sibling_hashes.data();
+  for (size_t i = 0; i < num_of_levels; i++) {
+    size_t before = proof.positions[i] * digest_len;
+    size_t after = (proof.group_sizes[i] - 1) * digest_len - before;
+    group.assign(sibling, sibling + before);
+    group.insert(group.end(), cur.begin(), cur.end());
+    group.insert(group.end(), sibling + before, sibling + before + after);
+    sibling += before + after;
+    hasher->get_hash(group.data(), group.size(), cur.data());
+  }
+  return memcmp(cur.data(), root_hash, digest_len) == 0;
+}
+
+// verify a range proof given the digests of its leaves in a single pass from
+// the leaves up: on each level the run of computed nodes is widened to whole
+// groups with the proof digests, and all its groups are hashed in one batch.
+// Returns false if the proof does not have exactly the digests its layout
+// needs.
+bool verify_range_proof(const MerkleRangeProof& proof,
+                        unsigned char* leaf_hashes, unsigned char* root_hash,
+                        Hasher* hasher) {
+  unsigned int digest_len = hasher->hash_length();
+  size_t k = proof.arity;
+  size_t first = proof.first;
+  size_t last = proof.last;
+  if (k < 2 || first >= last || last > proof.num_of_leaves ||
+      proof.hashes.size() % digest_len != 0) {
+    return false;
+  }
+  vector<unsigned char> cur(leaf_hashes,
+                            leaf_hashes + (last - first) * digest_len);
+  vector<unsigned char> groups;
+  const unsigned char* proof_hash = proof.hashes.data();
+  const unsigned char* proof_end = proof.hashes.data() + proof.hashes.size();
+  size_t size = proof.num_of_leaves;
+  while (size > 1) {
+    size_t group_begin = first / k * k;
+    size_t group_end = min((last + k - 1) / k * k, size);
+    size_t num_of_left = first - group_begin;
+    size_t num_of_right = group_end - last;
+    if ((size_t)(proof_end - proof_hash) <
+        (num_of_left + num_of_right) * digest_len) {
+      return false;
+    }
+    groups.assign(proof_hash, proof_hash + num_of_left * digest_len);
+    proof_hash += num_of_left * digest_len;
+    groups.insert(groups.end(), cur.begin(), cur.end());
+    groups.insert(groups.end(), proof_hash,
+                  proof_hash + num_of_right * digest_len);
+    proof_hash += num_of_right * digest_len;
+    // only the last group of a level may be short; a group of one is
+    // carried up as it is
+    size_t num_of_full_groups = (group_end - group_begin) / k;
+    size_t rest = (group_end - group_begin) % k;
+    cur.resize((num_of_full_groups + (rest > 0)) * digest_len);
+    hasher->get_hash(groups.data(), k * digest_len, cur.data(),
+                     num_of_full_groups);
+    unsigned char* rest_group = groups.data() +
+                                num_of_full_groups * k * digest_len;
+    unsigned char* rest_parent = cur.data() + num_of_full_groups * digest_len;
+    if (rest == 1) {
+      memcpy(rest_parent, rest_group, digest_len);
+    } else if (rest > 1) {
+      hasher->get_hash(rest_group, rest * digest_len, rest_parent);
+    }
+    first /= k;
+    last = (last + k - 1) / k;
+    size = (size + k - 1) / k;
+  }
+  return proof_hash == proof_end &&
+         memcmp(cur.data(), root_hash, digest_len) == 0;
+}
+
+// return the proof of a leaf of a MerkleTree in raw digests
+MerkleProof MerkleTree::find_proof(size_t leaf_index) {
+  MerkleProof proof;
+  if (levels.empty() || leaf_index >= levels[0].size()) {
+    return proof;
+  }
+  unsigned int digest_len = hasher->hash_length();
+  MerkleNode* cur_node = levels[0][leaf_index];
+  proof.leaf_hash.assign(cur_node->hash, cur_node->hash + digest_len);
+  for (MerkleNode* sibling : find_siblings(cur_node)) {
+    proof.sibling_hashes.insert(proof.sibling_hashes.end(), sibling->hash,
+                                sibling->hash + digest_len);
+    proof.lrs.push_back(sibling->lr);
+  }
+  return proof;
+}
+
+// return the proof of a leaf of a binary FlatMerkleTree in raw digests
+MerkleProof FlatMerkleTree::find_proof(size_t leaf_index) {
+  MerkleProof proof;
+  if (leaf_index >= num_of_leaves() || branching_factor != 2) {
+    return proof;
+  }
+  proof.leaf_hash.assign(node_hash(0, leaf_index),
+                         node_hash(0, leaf_index) + digest_len);
+  prefetch_path(leaf_index);
+  // straight from the nodes, without MerkleNodes in between
+  proof.sibling_hashes.reserve(num_of_levels() * digest_len);
+  proof.lrs.reserve(num_of_levels());
+  size_t index = leaf_index;
+  for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+    size_t sibling = index ^ 1;
+    if (sibling < level_size(level)) {
+      unsigned char* hash = node_hash(level, sibling);
+      proof.sibling_hashes.insert(proof.sibling_hashes.end(), hash,
+                                  hash + digest_len);
+      proof.lrs.push_back(sibling < index ? LEFT : RIGHT);
+    }
+    index /= 2;
+  }
+  return proof;
+}
+
+// return the proof of a leaf of a FlatMerkleTree of any arity
+KaryMerkleProof FlatMerkleTree::find_kary_proof(size_t leaf_index) {
+  KaryMerkleProof proof;
+  if (leaf_index >= num_of_leaves()) {
+    return proof;
+  }
+  prefetch_path(leaf_index);
+  proof.leaf_hash.assign(node_hash(0, leaf_index),
+                         node_hash(0, leaf_index) + digest_len);
+  size_t index = leaf_index;
+  for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+    auto [first, group_size] = group_of(level, index);
+    if (group_size > 1) {
+      for (size_t child = first; child < first + group_size; child++) {
+        if (child != index) {
+          proof.sibling_hashes.insert(proof.sibling_hashes.end(),
+                                      node_hash(level, child),
+                                      node_hash(level, child) + digest_len);
+        }
+      }
+      proof.positions.push_back(index - first);
+      proof.group_sizes.push_back(group_size);
+    }
+    index /= branching_factor;
+  }
+  return proof;
+}
+
+// return the multiproof of some leaves of a MerkleTree, or an empty one if
+// an index is out of range
+MerkleMultiProof MerkleTree::find_multiproof(vector<size_t> leaf_indices) {
+  if (levels.empty()) {
+    return MerkleMultiProof();
+  }
+  return make_multiproof(levels[0].size(), move(leaf_indices),
+                         hasher->hash_length(),
+                         [this](size_t level, size_t index) {
+                           return levels[level][index]->hash;
+                         });
+}
+
+// return the multiproof of some leaves of a binary FlatMerkleTree, or an
+// empty one if an index is out of range
+MerkleMultiProof FlatMerkleTree::find_multiproof(vector<size_t> leaf_indices) {
+  if (branching_factor != 2) {
+    return MerkleMultiProof();
+  }
+  return make_multiproof(num_of_leaves(), move(leaf_indices), digest_len,
+                         [this](size_t level, size_t index) {
+                           return node_hash(level, index);
+                         });
+}
+
+// return the range proof of the leaves [first, last) of a MerkleTree
+MerkleRangeProof MerkleTree::find_range_proof(size_t first, size_t last) {
+  if (levels.empty()) {
+    return MerkleRangeProof();
+  }
+  return make_range_proof(levels[0].size(), 2, first, last,
+                          hasher->hash_length(),
+                          [this](size_t level, size_t index) {
+                            return levels[level][index]->hash;
+                          });
+}
+
+// return the range proof of the leaves [first, last) of a FlatMerkleTree
+MerkleRangeProof FlatMerkleTree::find_range_proof(size_t first, size_t last) {
+  return make_range_proof(num_of_leaves(), branching_factor, first, last,
+                          digest_len, [this](size_t level, size_t index) {
+                            return node_hash(level, index);
+                          });
+}
+
+// return the multiproof of the leaves with some raw digests, back to back in
+// leaf_hashes, or an empty one if a digest is not in the MerkleTree
+MerkleMultiProof MerkleTree::find_multiproof(unsigned char* leaf_hashes,
+                                             size_t num_of_hashes) {
+  vector<size_t> leaf_indices;
+  for (size_t i = 0; i < num_of_hashes; i++) {
+    size_t leaf_index =
+        leaf_index_map.find(leaf_hashes + i * hasher->hash_length());
+    if (leaf_index == DigestMap::npos) {
+      return MerkleMultiProof();
+    }
+    leaf_indices.push_back(leaf_index);
+  }
+  return find_multiproof(move(leaf_indices));
+}
+
+// return the multiproof of the leaves with some raw digests, back to back in
+// leaf_hashes, or an empty one if a digest is not in the FlatMerkleTree
+MerkleMultiProof FlatMerkleTree::find_multiproof(unsigned char* leaf_hashes,
+                                                 size_t num_of_hashes) {
+  vector<size_t> leaf_indices;
+  for (size_t i = 0; i < num_of_hashes; i++) {
+    size_t leaf_index = find_leaf(leaf_hashes + i * digest_len);
+    if (leaf_index == num_of_leaves()) {
+      return MerkleMultiProof();
+    }
+    leaf_indices.push_back(leaf_index);
+  }
+  return find_multiproof(move(leaf_indices));
+}
@@ -1,7 +1,13 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <openssl/sha.h>
 #include <openssl/md5.h>
 #include "../merkle_tree.hpp"
+#include "../cpu_hash_lib/blake3.h"
+#include "../cpu_hash_lib/fastcdc.h"
+#include "../cpu_hash_lib/sha256.h"
+#include "../cpu_hash_lib/xxh3.h"
 
 using namespace std;
 
@@ -29,19 +35,115 @@ void hex_string_to_hash(string hash_str, unsigned char* hash, int size) {
   }
 }
 
+// return the number of blocks data_len bytes are split into
+size_t num_of_blocks(size_t data_len) {
+  return num_of_blocks(data_len, BLOCK_SIZE);
+}
+
+size_t num_of_blocks(size_t data_len, size_t block_size) {
+  return (data_len + block_size - 1) / block_size;
+}
+
+size_t num_of_levels(size_t num_of_leaves, unsigned int arity) {
+  size_t levels = num_of_leaves > 0 ? 1 : 0;
+  for (size_t size = num_of_leaves; size > 1;
+       size = num_of_blocks(size, arity)) {
+    levels++;
+  }
+  return levels;
+}
+
+void hash_blocks(unsigned char* data, size_t data_len, Hasher* hasher,
+                 unsigned char* hashes, ThreadPool& pool) {
+  hash_blocks(data, data_len, BLOCK_SIZE, hasher, hashes, pool);
+}
+
+// hash data block by block into hashes, reading the blocks in place instead
+// of copying them into Blocks. Only the last short block is copied, to pad it
+// with zeros the same way Blocks does.
+void hash_blocks(unsigned char* data, size_t data_len, size_t block_size,
+                 Hasher* hasher, unsigned char* hashes, ThreadPool& pool) {
+  size_t num_of_full_blocks = data_len / block_size;
+  unsigned int digest_len = hasher->hash_length();
+  pool.parallel_for(num_of_full_blocks, [&](size_t begin, size_t end) {
+    hasher->get_hash(data + begin * block_size, block_size,
+                     hashes + begin * digest_len, end - begin);
+  });
+  size_t offset = num_of_full_blocks * block_size;
+  if (offset < data_len) {
+    vector<unsigned char> last_block(block_size, 0);
+    memcpy(last_block.data(), data + offset, data_len - offset);
+    hasher->get_hash(last_block.data(), block_size,
+                     hashes + num_of_full_blocks * digest_len);
+  }
+}
+
+// hash the blocks of a mapped file like hash_blocks() above, a window at a
+// time, and drop each window from memory once it is hashed, so the file
+// never takes more than a window of resident memory
+void hash_blocks(MappedFile& file, size_t block_size, Hasher* hasher,
+                 unsigned char* hashes, ThreadPool& pool) {
+  const size_t window_size =
+      max<size_t>((64 << 20) / block_size, 1) * block_size;
+  unsigned int digest_len = hasher->hash_length();
+  for (size_t offset = 0; offset < file.size(); offset += window_size) {
+    size_t len = min(window_size, file.size() - offset);
+    hash_blocks(file.data() + offset, len, block_size, hasher,
+                hashes + offset / block_size * digest_len, pool);
+    file.release(offset, len);
+  }
+}
+
+// cut data into content-defined chunks with FastCDC
+vector<size_t> find_chunk_ends(unsigned char* data, size_t data_len,
+                               const ChunkingParams& chunking) {
+  vector<size_t> chunk_ends;
+  fastcdc_chunk_ends(data, data_len, chunking.min_size, chunking.avg_size,
+                     chunking.max_size, chunk_ends);
+  return chunk_ends;
+}
+
+// hash each chunk of data in place; unlike blocks, chunks are of different
+// lengths, so they are hashed one per call
+void hash_chunks(unsigned char* data, const vector<size_t>& chunk_ends,
+                 Hasher* hasher, unsigned char* hashes, ThreadPool& pool) {
+  unsigned int digest_len = hasher->hash_length();
+  pool.parallel_for(chunk_ends.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      size_t start = i == 0 ? 0 : chunk_ends[i - 1];
+      hasher->get_hash(data + start, chunk_ends[i] - start,
+                       hashes + i * digest_len);
+    }
+  });
+}
+
 SHA_256::SHA_256() {
   digest_size = SHA256_DIGEST_LENGTH;
+  hasher_id = HASHER_SHA_256;
 }
 
 void SHA_256::get_hash(unsigned char* data,
                         int data_len,
                         unsigned char* hash) {
+  // a parent of two digests goes through the fixed two-block path
+  if (data_len == SHA256_DIGEST_LENGTH * 2) {
+    sha256_hash_pair(data, data + SHA256_DIGEST_LENGTH, hash);
+    return;
+  }
   SHA256(data, data_len, hash);
 }
 
+void SHA_256::get_hash(unsigned char* din,
+                       int block_size,
+                       unsigned char* dout,
+                       int num_of_blocks) {
+  sha256_multi_buffer(din, block_size, dout, num_of_blocks);
+}
+
 
 MD_5::MD_5() {
   digest_size = MD5_DIGEST_LENGTH;
+  hasher_id = HASHER_MD_5;
 }
 
 void MD_5::get_hash(unsigned char* data,
@@ -50,12 +152,61 @@ void MD_5::get_hash(unsigned char* data,
   MD5(data, data_len, hash);
 }
 
+BLAKE_3::BLAKE_3() {
+  digest_size = 32;
+  hasher_id = HASHER_BLAKE_3;
+}
+
+void BLAKE_3::get_hash(unsigned char* data,
+                       int data_len,
+                       unsigned char* hash) {
+  blake3(data, data_len, hash);
+}
+
+void BLAKE_3::get_hash(unsigned char* din,
+                       int block_size,
+                       unsigned char* dout,
+                       int num_of_blocks) {
+  blake3_multi_buffer(din, block_size, dout, num_of_blocks);
+}
+
+XXH3_128::XXH3_128() {
+  digest_size = 16;
+  hasher_id = HASHER_XXH3_128;
+}
+
+void XXH3_128::get_hash(unsigned char* data,
+                        int data_len,
+                        unsigned char* hash) {
+  xxh3_128(data, data_len, hash);
+}
+
+Hasher* new_hasher(string name) {
+  if (name == "sha256") {
+    return new SHA_256();
+  }
+  if (name == "md5") {
+    return new MD_5();
+  }
+  if (name == "blake3") {
+    return new BLAKE_3();
+  }
+  if (name == "xxh3") {
+    return new XXH3_128();
+  }
+  return nullptr;
+}
+
 
 //
 // Class Block
 //
 Block::Block() {
-  data = (unsigned char *)calloc(BLOCK_SIZE, sizeof(unsigned char));
+  data = (unsigned char *)calloc(size, sizeof(unsigned char));
+}
+
+Block::Block(size_t size_) : size(size_) {
+  data = (unsigned char *)calloc(size, sizeof(unsigned char));
 }
 
 //
@@ -70,17 +221,19 @@ Blocks::~Blocks() {
   }
 }
 vector<Block> const &Blocks::blocks() { return _blocks; }
-Blocks::Blocks(unsigned char *data, int data_len) {
-  int num_of_blocks = data_len / BLOCK_SIZE;
+Blocks::Blocks(unsigned char *data, int data_len)
+    : Blocks(data, data_len, BLOCK_SIZE) {}
+Blocks::Blocks(unsigned char *data, int data_len, size_t block_size) {
+  int num_of_blocks = data_len / block_size;
   int offset = 0;
   for (int i = 0; i < num_of_blocks; i++) {
-    Block b;
-    memcpy(b.data, data + offset, BLOCK_SIZE);
-    offset += BLOCK_SIZE;
+    Block b(block_size);
+    memcpy(b.data, data + offset, block_size);
+    offset += block_size;
     _blocks.push_back(b);
   }
   if (offset < data_len) {
-    Block b;
+    Block b(block_size);
     memcpy(b.data, data + offset, data_len - offset);
     _blocks.push_back(b);
   }
@@ -90,6 +243,80 @@ void Blocks::add_blocks(Blocks &new_blocks) {
                  new_blocks.blocks().end());
 }
 
+//
+// Class ThreadPool
+//
+ThreadPool::ThreadPool(unsigned int num_threads) : busy(0), stopping(false) {
+  // the calling thread takes part in parallel_for, so spawn one less
+  for (unsigned int i = 1; i < num_threads; i++) {
+    workers.emplace_back(&ThreadPool::worker_loop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    unique_lock<mutex> lock(mtx);
+    stopping = true;
+  }
+  task_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+unsigned int ThreadPool::size() const { return workers.size() + 1; }
+
+void ThreadPool::worker_loop() {
+  while (true) {
+    function<void()> task;
+    {
+      unique_lock<mutex> lock(mtx);
+      task_cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+      if (stopping && tasks.empty()) {
+        return;
+      }
+      task = move(tasks.front());
+      tasks.pop();
+      busy++;
+    }
+    task();
+    {
+      unique_lock<mutex> lock(mtx);
+      busy--;
+    }
+    done_cv.notify_all();
+  }
+}
+
+void ThreadPool::parallel_for(size_t n, function<void(size_t, size_t)> fn) {
+  // too little work to be worth waking up the workers
+  const size_t min_grain = 64;
+  if (workers.empty() || n <= min_grain) {
+    fn(0, n);
+    return;
+  }
+  // hand out small chunks from a shared counter, so threads that finish
+  // early keep taking work from the slower ones.
+  size_t grain = max(min_grain, n / (size() * 8));
+  atomic<size_t> next(0);
+  auto run_chunks = [&next, &fn, grain, n] {
+    size_t begin;
+    while ((begin = next.fetch_add(grain)) < n) {
+      fn(begin, min(begin + grain, n));
+    }
+  };
+  {
+    unique_lock<mutex> lock(mtx);
+    for (size_t i = 0; i < workers.size(); i++) {
+      tasks.push(run_chunks);
+    }
+  }
+  task_cv.notify_all();
+  run_chunks();
+  unique_lock<mutex> lock(mtx);
+  done_cv.wait(lock, [this] { return tasks.empty() && busy == 0; });
+}
+
 //
 // class MerkleNode
 //
@@ -118,7 +345,7 @@ MerkleNode::MerkleNode(const Block &block, Hasher* hasher)
     : parent(nullptr), left(nullptr), right(nullptr), lr(NA),
       digest_len(hasher->hash_length()) {
   hash = (unsigned char*)calloc(digest_len, sizeof(unsigned char));
-  hasher->get_hash(block.data, BLOCK_SIZE, hash);
+  hasher->get_hash(block.data, block.size, hash);
 }
 
 // make a parent MerkleNode from two child MerkleNodes (lhs, rhs)
@@ -130,6 +357,7 @@ MerkleNode::MerkleNode(MerkleNode *lhs, MerkleNode *rhs, Hasher* hasher)
   memcpy(data, lhs->hash, digest_len);
   memcpy(data + digest_len, rhs->hash, digest_len);
   hasher->get_hash(data, digest_len * 2, hash);
+  free(data);
   left = lhs;
   right = rhs;
   lhs->parent = this; // connect parent
@@ -154,6 +382,7 @@ MerkleNode::MerkleNode(MerkleNode cur_node, MerkleNode *sibling, Hasher* hasher)
     memcpy(data + digest_len, sibling->hash, digest_len);
   }
   hasher->get_hash(data, digest_len * 2, hash);
+  free(data);
 }
 
 // make a parent MerkleNode from an existing MerkleNode and its siblings,
@@ -172,6 +401,7 @@ MerkleNode::MerkleNode(MerkleNode cur_node, MerkleNode sibling, Hasher* hasher)
     memcpy(data + digest_len, sibling.hash, digest_len);
   }
   hasher->get_hash(data, digest_len * 2, hash);
+  free(data);
 }
 
 // print the hash of a MerkleNode in hex string format
@@ -198,36 +428,179 @@ void MerkleNode::print_info() {
 //
 // Class MerkleTree
 //
-void MerkleTree::delete_tree_walker(MerkleNode *cur_node) {
-  if (cur_node == nullptr) {
-    return;
+
+// replace cur with the digest of its parent, given the digest of its sibling
+// and the side of the sibling; the same as MerkleNode(cur_node, sibling,
+// hasher) without a MerkleNode to leak
+static void hash_with_sibling(vector<unsigned char>& cur,
+                              unsigned char* sibling_hash, LeftOrRightSib lr,
+                              Hasher* hasher) {
+  unsigned int digest_len = cur.size();
+  vector<unsigned char> data(digest_len * 2);
+  if (lr == LEFT) {
+    memcpy(data.data(), sibling_hash, digest_len);
+    memcpy(data.data() + digest_len, cur.data(), digest_len);
+  } else {
+    memcpy(data.data(), cur.data(), digest_len);
+    memcpy(data.data() + digest_len, sibling_hash, digest_len);
   }
-  delete_tree_walker(cur_node->left);
-  delete_tree_walker(cur_node->right);
-  delete (cur_node);
+  hasher->get_hash(data.data(), digest_len * 2, cur.data());
 }
-
 // produce a MerkleTree from hashes
 MerkleNode *
 MerkleTree::make_tree_from_hashes(vector<MerkleNode *>& cur_layer_nodes) {
-  int cur_layer_nodes_size = cur_layer_nodes.size();
-  while (cur_layer_nodes_size > 1) {
-    cur_layer_nodes_size = cur_layer_nodes.size();
-    int count = 0;
-    for (int i = 0; i < cur_layer_nodes_size - 1; i = i + 2) {
-      cur_layer_nodes[count] =
-          new MerkleNode(cur_layer_nodes[i], cur_layer_nodes[i + 1], hasher);
-      count++;
+  ThreadPool serial(1);
+  return make_tree_from_hashes(cur_layer_nodes, serial);
+}
+
+// produce a MerkleTree from hashes, hashing each layer on all threads of
+// the pool. The result is identical to a serial build.
+MerkleNode *
+MerkleTree::make_tree_from_hashes(vector<MerkleNode *>& cur_layer_nodes,
+                                  ThreadPool& pool) {
+  levels.assign(1, cur_layer_nodes);
+  return rehash_levels(0, pool);
+}
+
+// add the leaves from levels[0][first] on to leaf_index_map. Later leaves
+// replace earlier ones with the same digest, and join them in leaf_copies.
+void MerkleTree::index_leaves(size_t first) {
+  vector<MerkleNode *>& leaves = levels[0];
+  if (first == 0) {
+    leaf_index_map.reset(hasher->hash_length());
+    leaf_copies.clear();
+  }
+  leaf_index_map.reserve(leaves.size());
+  for (size_t i = first; i < leaves.size(); i++) {
+    add_leaf_index(i);
+  }
+}
+
+// index leaf leaf_index by its digest, linking it into the ring of the
+// leaves with the same digest if there are any
+void MerkleTree::add_leaf_index(size_t leaf_index) {
+  unsigned char* hash = levels[0][leaf_index]->hash;
+  size_t other = leaf_index_map.find(hash);
+  if (other != DigestMap::npos) {
+    auto found = leaf_copies.find(other);
+    if (found == leaf_copies.end()) {
+      found = leaf_copies.emplace(other, make_pair(other, other)).first;
     }
-    if (count > 0 && cur_layer_nodes_size % 2 != 0) {
-      cur_layer_nodes[count] = cur_layer_nodes[cur_layer_nodes_size - 1];
-      cur_layer_nodes.resize(count + 1);
-    } else {
-      cur_layer_nodes.resize(count);
+    size_t next = found->second.second;
+    found->second.second = leaf_index;
+    leaf_copies[next].first = leaf_index;
+    leaf_copies[leaf_index] = {other, next};
+  }
+  leaf_index_map.insert(hash, leaf_index);
+}
+
+// drop leaf leaf_index from the index before its digest changes. If another
+// leaf has the same digest, the entry is pointed to that leaf instead.
+void MerkleTree::remove_leaf_index(size_t leaf_index) {
+  unsigned char* hash = levels[0][leaf_index]->hash;
+  bool indexed = leaf_index_map.find(hash) == leaf_index;
+  auto found = leaf_copies.find(leaf_index);
+  if (found == leaf_copies.end()) {
+    if (indexed) {
+      leaf_index_map.erase(hash);
+    }
+    return;
+  }
+  auto [prev, next] = found->second;
+  leaf_copies.erase(found);
+  if (prev == next) {
+    leaf_copies.erase(next);
+  } else {
+    leaf_copies[prev].second = next;
+    leaf_copies[next].first = prev;
+  }
+  if (indexed) {
+    leaf_index_map.insert(hash, next);
+  }
+}
+
+// recompute the hashes of existing parent nodes from their left and right
+// children, and link the children to them. The pairs are hashed in batches
+// so that a multi-buffer Hasher can hash them side by side.
+void MerkleTree::rehash_nodes(MerkleNode** nodes, size_t num_of_nodes) {
+  const size_t batch_size = 256;
+  unsigned int digest_len = hasher->hash_length();
+  size_t n = min(num_of_nodes, batch_size);
+  vector<unsigned char> data(n * digest_len * 2);
+  vector<unsigned char> hashes(n * digest_len);
+  for (size_t first = 0; first < num_of_nodes; first += batch_size) {
+    n = min(batch_size, num_of_nodes - first);
+    for (size_t i = 0; i < n; i++) {
+      MerkleNode* node = nodes[first + i];
+      memcpy(data.data() + i * digest_len * 2, node->left->hash, digest_len);
+      memcpy(data.data() + i * digest_len * 2 + digest_len, node->right->hash,
+             digest_len);
+    }
+    hasher->get_hash(data.data(), digest_len * 2, hashes.data(), n);
+    for (size_t i = 0; i < n; i++) {
+      MerkleNode* node = nodes[first + i];
+      memcpy(node->hash, hashes.data() + i * digest_len, digest_len);
+      node->left->parent = node;
+      node->right->parent = node;
+      node->left->lr = LEFT;
+      node->right->lr = RIGHT;
     }
   }
-  assert(cur_layer_nodes[0]->parent == nullptr);
-  return cur_layer_nodes[0];
+}
+
+// bring the layers above the leaves up to date, given that only the leaves
+// from levels[0][first_dirty] on are new. Only parents of new or changed
+// nodes are hashed: existing ones are rehashed in place and the others are
+// created, so k new leaves cost O(k + log n) hashes.
+MerkleNode* MerkleTree::rehash_levels(size_t first_dirty, ThreadPool& pool) {
+  if (levels.empty() || levels[0].empty()) {
+    return nullptr;
+  }
+  // pairs in the layer before the new leaves came in
+  size_t old_num_of_pairs = first_dirty / 2;
+  size_t level = 0;
+  for (; levels[level].size() > 1; level++) {
+    if (level + 1 == levels.size()) {
+      levels.emplace_back();
+    }
+    vector<MerkleNode *>& cur_layer_nodes = levels[level];
+    vector<MerkleNode *>& next_layer_nodes = levels[level + 1];
+    size_t num_of_pairs = cur_layer_nodes.size() / 2;
+    size_t old_num_of_parents = next_layer_nodes.size();
+    next_layer_nodes.resize((cur_layer_nodes.size() + 1) / 2);
+    size_t first_parent = first_dirty / 2;
+    if (first_parent < num_of_pairs) {
+      // parents from first_new_parent on are new; an old orphan carried up
+      // is not a parent node to reuse
+      size_t first_new_parent = max(first_parent, old_num_of_pairs);
+      MerkleNode* new_parents = nullptr;
+      if (first_new_parent < num_of_pairs) {
+        new_parents = node_arena.new_nodes(num_of_pairs - first_new_parent,
+                                           hasher->hash_length());
+      }
+      pool.parallel_for(num_of_pairs - first_parent,
+                        [&](size_t begin, size_t end) {
+        for (size_t i = first_parent + begin; i < first_parent + end; i++) {
+          if (i >= first_new_parent) {
+            next_layer_nodes[i] = new_parents + (i - first_new_parent);
+          }
+          next_layer_nodes[i]->left = cur_layer_nodes[i * 2];
+          next_layer_nodes[i]->right = cur_layer_nodes[i * 2 + 1];
+        }
+        rehash_nodes(next_layer_nodes.data() + first_parent + begin,
+                     end - begin);
+      });
+    }
+    // carry the orphan node to the next layer
+    if (cur_layer_nodes.size() % 2 != 0) {
+      next_layer_nodes[num_of_pairs] = cur_layer_nodes.back();
+    }
+    first_dirty = first_parent;
+    old_num_of_pairs = old_num_of_parents / 2;
+  }
+  levels.resize(level + 1);
+  assert(levels[level][0]->parent == nullptr);
+  return levels[level][0];
 }
 
 // produce a MerkleTree from Blocks and assign the head to root
@@ -236,22 +609,25 @@ MerkleNode *MerkleTree::make_tree_from_blocks(Blocks &blocks) {
     return nullptr;
   }
   vector<MerkleNode *> cur_layer_nodes;
+  MerkleNode* leaves = node_arena.new_nodes(blocks.blocks().size(),
+                                            hasher->hash_length());
   for (const auto &block : blocks.blocks()) {
-    MerkleNode *to_add = new MerkleNode(block, hasher);
-    cur_layer_nodes.push_back(to_add);
-    string hash_str = hash_to_hex_string(to_add->hash, hasher->hash_length());
-    hashes.push_back(to_add);
-    hash_leaf_map[hash_str] = to_add;
+    hasher->get_hash(block.data, block.size, leaves->hash);
+    cur_layer_nodes.push_back(leaves++);
   }
-  return make_tree_from_hashes(cur_layer_nodes);
+  ThreadPool serial(1);
+  MerkleNode* root_node = make_tree_from_hashes(cur_layer_nodes, serial);
+  index_leaves(0);
+  return root_node;
 }
 
 // helper functions in verification process
 bool MerkleTree::verify(MerkleNode cur_node, vector<MerkleNode *> &siblings) {
+  vector<unsigned char> cur(cur_node.hash, cur_node.hash + cur_node.digest_len);
   for (const auto &sibling : siblings) {
-    cur_node = MerkleNode(cur_node, sibling, hasher);
+    hash_with_sibling(cur, sibling->hash, sibling->lr, hasher);
   }
-  if (memcmp(cur_node.hash, root->hash, hasher->hash_length()) == 0) {
+  if (memcmp(cur.data(), root->hash, hasher->hash_length()) == 0) {
     return true;
   } else {
     return false;
@@ -284,6 +660,9 @@ void MerkleTree::print() {
 
 // return a string contains the root hash of the MerkleTree in hex string format
 string MerkleTree::root_hash() {
+  if (root == nullptr) {
+    return "";
+  }
   return hash_to_hex_string(root->hash, hasher->hash_length());
 }
 
@@ -293,37 +672,238 @@ void MerkleTree::print_root_hash() { cout << root_hash() << endl; }
 // constructor with only Hasher
 MerkleTree::MerkleTree(Hasher* hasher_) : hasher(hasher_) {}
 
+// constructor of an empty tree with options
+MerkleTree::MerkleTree(Hasher* hasher_, const TreeOptions& options)
+    : hasher(hasher_), num_threads(max(options.num_threads, 1u)),
+      block_len(max<size_t>(options.block_size, 1)) {}
+
 // constructor using Blocks
 MerkleTree::MerkleTree(Blocks& blocks_, Hasher* hasher_) : hasher(hasher_) {
+  if (!blocks_.blocks().empty()) {
+    block_len = blocks_.blocks()[0].size;
+  }
   root = make_tree_from_blocks(blocks_);
 }
 
 // constructor using data in unsigned char and data_len
 MerkleTree::MerkleTree(unsigned char* data, int data_len, Hasher* hasher_) 
     : hasher(hasher_) {
-  Blocks blocks(data, data_len);
-  root = make_tree_from_blocks(blocks);
+  root = make_tree_cpu_accel(data, data_len, NO_ACCEL);
+}
+
+// constructor with CPU acceleration; uses all hardware threads
+MerkleTree::MerkleTree(unsigned char* data, int data_len, Hasher* hasher_,
+                       unsigned short accel_mask)
+    : hasher(hasher_), num_threads(max(thread::hardware_concurrency(), 1u)) {
+  root = make_tree_cpu_accel(data, data_len, accel_mask);
+}
+
+// constructor with the threads, CPU acceleration and block size of options
+MerkleTree::MerkleTree(unsigned char* data, int data_len, Hasher* hasher_,
+                       const TreeOptions& options)
+    : MerkleTree(hasher_, options) {
+  root = make_tree_cpu_accel(data, data_len, options.accel_mask);
 }
 
-// delete the MerkleTree
+// constructor hashing a file straight from its mapping in memory
+MerkleTree::MerkleTree(string path, Hasher* hasher_,
+                       const TreeOptions& options)
+    : MerkleTree(hasher_, options) {
+  MappedFile file(path);
+  if (file.is_open()) {
+    root = make_tree_cpu_accel(file.data(), file.size(), options.accel_mask,
+                               &file);
+  }
+}
+
+// hash the leaves straight from data and reduce the layers, on num_threads
+// threads for ACCEL_CPU_CREATION and/or ACCEL_CPU_REDUCTION respectively.
+// If data is the mapping of file, its pages are released once hashed.
+MerkleNode* MerkleTree::make_tree_cpu_accel(unsigned char* data,
+                                            size_t data_len,
+                                            unsigned short accel_mask,
+                                            MappedFile* file) {
+  size_t num_of_leaves = num_of_blocks(data_len, block_len);
+  if (num_of_leaves == 0) {
+    return nullptr;
+  }
+  bool threaded = accel_mask & (ACCEL_CPU_CREATION | ACCEL_CPU_REDUCTION);
+  ThreadPool pool(threaded ? num_threads : 1);
+  ThreadPool serial(1);
+  ThreadPool& creation_pool =
+      (accel_mask & ACCEL_CPU_CREATION) ? pool : serial;
+  ThreadPool& reduction_pool =
+      (accel_mask & ACCEL_CPU_REDUCTION) ? pool : serial;
+
+  unsigned int digest_len = hasher->hash_length();
+  vector<unsigned char> leaf_hashes(num_of_leaves * digest_len);
+  if (file != nullptr) {
+    hash_blocks(*file, block_len, hasher, leaf_hashes.data(), creation_pool);
+  } else {
+    hash_blocks(data, data_len, block_len, hasher, leaf_hashes.data(),
+                creation_pool);
+  }
+
+  vector<MerkleNode *> cur_layer_nodes(num_of_leaves);
+  MerkleNode* leaves = node_arena.new_nodes(num_of_leaves, digest_len);
+  creation_pool.parallel_for(num_of_leaves, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      cur_layer_nodes[i] = leaves + i;
+      memcpy(leaves[i].hash, leaf_hashes.data() + i * digest_len, digest_len);
+    }
+  });
+  vector<unsigned char>().swap(leaf_hashes);
+  MerkleNode* root_node = make_tree_from_hashes(cur_layer_nodes,
+                                                reduction_pool);
+  index_leaves(0);
+  return root_node;
+}
+
+const NodeArena& MerkleTree::arena() const { return node_arena; }
+
+size_t MerkleTree::block_size() const { return block_len; }
+
+// delete the MerkleTree, freeing all of its nodes at once
 void MerkleTree::delete_tree() {
-  delete_tree_walker(root);
+  node_arena.clear();
   root = nullptr;
+  levels.clear();
+  leaf_index_map.reset(hasher->hash_length());
+  leaf_copies.clear();
+}
+
+// add new leaves to the right of the tree and rehash only the nodes on
+// their paths to the root
+void MerkleTree::append_leaves(vector<MerkleNode *>& new_leaves) {
+  if (new_leaves.empty()) {
+    return;
+  }
+  if (levels.empty()) {
+    levels.emplace_back();
+  }
+  size_t first = levels[0].size();
+  levels[0].insert(levels[0].end(), new_leaves.begin(), new_leaves.end());
+  ThreadPool serial(1);
+  root = rehash_levels(first, serial);
+  index_leaves(first);
 }
 
-// TODO(allenpthuang): Naive way to append blocks! Should be more efficient.
 void MerkleTree::append(Blocks &new_blocks) {
+  vector<MerkleNode *> new_leaves;
+  MerkleNode* leaves = node_arena.new_nodes(new_blocks.blocks().size(),
+                                            hasher->hash_length());
   for (const auto& block : new_blocks.blocks()) {
-    MerkleNode* to_add = new MerkleNode(block, hasher);
-    hashes.push_back(to_add);
+    hasher->get_hash(block.data, block.size, leaves->hash);
+    new_leaves.push_back(leaves++);
   }
-  delete_tree();
-  root = make_tree_from_hashes(hashes);
+  append_leaves(new_leaves);
 }
 
 void MerkleTree::append(unsigned char* data, int data_len) {
-  Blocks blocks_to_append(data, data_len);
-  append(blocks_to_append);
+  unsigned int digest_len = hasher->hash_length();
+  vector<unsigned char> new_hashes(num_of_blocks(data_len, block_len) *
+                                   digest_len);
+  ThreadPool serial(1);
+  hash_blocks(data, data_len, block_len, hasher, new_hashes.data(), serial);
+  vector<MerkleNode *> new_leaves;
+  MerkleNode* leaves =
+      node_arena.new_nodes(new_hashes.size() / digest_len, digest_len);
+  for (size_t i = 0; i < new_hashes.size(); i += digest_len) {
+    memcpy(leaves->hash, new_hashes.data() + i, digest_len);
+    new_leaves.push_back(leaves++);
+  }
+  append_leaves(new_leaves);
+}
+
+// replace the data of one leaf and rehash its path to the root
+bool MerkleTree::update(size_t leaf_index, unsigned char* data, int data_len) {
+  vector<LeafUpdate> updates = {{leaf_index, data, data_len}};
+  return update(updates);
+}
+
+// replace the data of many leaves and rehash only their paths to the root.
+// Paths are merged level by level, so a parent shared by several updated
+// leaves is hashed once. If a leaf is updated more than once, the last update
+// wins. Returns false, without changing anything, if an update is invalid.
+bool MerkleTree::update(vector<LeafUpdate>& updates) {
+  if (updates.empty()) {
+    return true;
+  }
+  size_t num_of_leaves = levels.empty() ? 0 : levels[0].size();
+  for (const auto& leaf_update : updates) {
+    if (leaf_update.leaf_index >= num_of_leaves ||
+        leaf_update.data_len < 0 ||
+        (size_t)leaf_update.data_len > block_len) {
+      return false;
+    }
+  }
+
+  unsigned int digest_len = hasher->hash_length();
+  ThreadPool pool(updates.size() >= 4096 ? num_threads : 1);
+  vector<unsigned char> new_hashes(updates.size() * digest_len);
+  pool.parallel_for(updates.size(), [&](size_t begin, size_t end) {
+    vector<unsigned char> block(block_len);
+    for (size_t i = begin; i < end; i++) {
+      const LeafUpdate& leaf_update = updates[i];
+      unsigned char* data = leaf_update.data;
+      if ((size_t)leaf_update.data_len < block_len) {
+        fill(block.begin(), block.end(), 0);
+        memcpy(block.data(), leaf_update.data, leaf_update.data_len);
+        data = block.data();
+      }
+      hasher->get_hash(data, block_len, new_hashes.data() + i * digest_len);
+    }
+  });
+
+  vector<size_t> dirty;
+  for (size_t i = 0; i < updates.size(); i++) {
+    MerkleNode* leaf = levels[0][updates[i].leaf_index];
+    remove_leaf_index(updates[i].leaf_index);
+    memcpy(leaf->hash, new_hashes.data() + i * digest_len, digest_len);
+    add_leaf_index(updates[i].leaf_index);
+    dirty.push_back(updates[i].leaf_index);
+  }
+  sort(dirty.begin(), dirty.end());
+  dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+
+  // walk up one layer at a time; an orphan carried up is the same node in
+  // the next layer, so it needs no hashing
+  for (size_t level = 0; level + 1 < levels.size(); level++) {
+    size_t num_of_pairs = levels[level].size() / 2;
+    for (auto& index : dirty) {
+      index /= 2;
+    }
+    dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+    size_t num_of_dirty_pairs =
+        lower_bound(dirty.begin(), dirty.end(), num_of_pairs) - dirty.begin();
+    pool.parallel_for(num_of_dirty_pairs, [&](size_t begin, size_t end) {
+      vector<MerkleNode *> nodes;
+      for (size_t i = begin; i < end; i++) {
+        nodes.push_back(levels[level + 1][dirty[i]]);
+      }
+      rehash_nodes(nodes.data(), nodes.size());
+    });
+  }
+  return true;
+}
+
+// return the leaf with a raw digest, or nullptr if there is none
+MerkleNode* MerkleTree::find_leaf(unsigned char* hash) {
+  size_t leaf_index = leaf_index_map.find(hash);
+  if (leaf_index == DigestMap::npos) {
+    return nullptr;
+  }
+  return levels[0][leaf_index];
+}
+
+// return the leaf with hash_str, or nullptr if there is none
+MerkleNode* MerkleTree::find_leaf(string hash_str) {
+  if (hash_str.size() != hasher->hash_length() * 2) {
+    return nullptr;
+  }
+  vector<unsigned char> hash(hasher->hash_length());
+  hex_string_to_hash(hash_str, hash.data(), hasher->hash_length());
+  return find_leaf(hash.data());
 }
 
 // return a vector of the pointer to the sibling MerkleNodes along
@@ -344,11 +924,8 @@ vector<MerkleNode *> MerkleTree::find_siblings(MerkleNode *leaf) {
 
 // return a vector of the sibling MerkleNodes along the path to the root.
 vector<MerkleNode> MerkleTree::find_siblings(string hash_str) {
-  MerkleNode *cur_node;
-  auto it = hash_leaf_map.find(hash_str);
-  if (it != hash_leaf_map.end()) {
-    cur_node = it->second;
-  } else {
+  MerkleNode *cur_node = find_leaf(hash_str);
+  if (cur_node == nullptr) {
     return {};
   }
 
@@ -368,9 +945,14 @@ vector<MerkleNode> MerkleTree::find_siblings(string hash_str) {
 
 // verify whether a piece of data exists in the MerkleTree
 bool MerkleTree::verify(unsigned char *data, int data_len) {
-  Blocks blocks_to_verify(data, data_len);
-  for (auto block : blocks_to_verify.blocks()) {
-    if (!verify(block)) {
+  unsigned int digest_len = hasher->hash_length();
+  vector<unsigned char> hashes_to_verify(num_of_blocks(data_len, block_len) *
+                                         digest_len);
+  ThreadPool serial(1);
+  hash_blocks(data, data_len, block_len, hasher, hashes_to_verify.data(),
+              serial);
+  for (size_t i = 0; i < hashes_to_verify.size(); i += digest_len) {
+    if (!verify(hashes_to_verify.data() + i)) {
       return false;
     }
   }
@@ -379,24 +961,29 @@ bool MerkleTree::verify(unsigned char *data, int data_len) {
 
 // verify whether a block of data exists in the MerkleTree
 bool MerkleTree::verify(Block &block) {
-  unsigned char* hash =
-      (unsigned char*)calloc(hasher->hash_length(), sizeof(unsigned char));
-  hasher->get_hash(block.data, BLOCK_SIZE, hash);
-  return verify(hash_to_hex_string(hash, hasher->hash_length()));
+  vector<unsigned char> hash(hasher->hash_length());
+  hasher->get_hash(block.data, block.size, hash.data());
+  return verify(hash.data());
 }
 
 // verify whether a hash_str of some data exists in the MerkleTree
 bool MerkleTree::verify(string hash_str) {
-  if (hash_str.size() != hasher->hash_length() * 2) {
+  MerkleNode *node = find_leaf(hash_str);
+  if (node == nullptr) {
     return false;
   }
-  if (hash_leaf_map.find(hash_str) == hash_leaf_map.end()) {
+  auto siblings = find_siblings(node);
+  return verify(*node, siblings);
+}
+
+// verify whether the raw digest of some data exists in the MerkleTree
+bool MerkleTree::verify(unsigned char* hash) {
+  MerkleNode *node = find_leaf(hash);
+  if (node == nullptr) {
     return false;
   }
-  MerkleNode *node = hash_leaf_map[hash_str];
-  MerkleNode input = (*node);
   auto siblings = find_siblings(node);
-  return verify(input, siblings);
+  return verify(*node, siblings);
 }
 
 
@@ -405,11 +992,13 @@ bool MerkleTree::verify(string hash_str) {
 // using only sibling MerkleNodes and the root hash.
 bool MerkleTree::verify(string hash_str, vector<MerkleNode> &siblings,
                         string root_hash) {
-  MerkleNode cur_node(hash_str, hasher);
+  vector<unsigned char> cur(hasher->hash_length());
+  assert(hash_str.size() == cur.size() * 2);
+  hex_string_to_hash(hash_str, cur.data(), cur.size());
   for (const auto &sibling : siblings) {
-    cur_node = MerkleNode(cur_node, sibling, hasher);
+    hash_with_sibling(cur, sibling.hash, sibling.lr, hasher);
   }
-  string calculated = hash_to_hex_string(cur_node.hash, hasher->hash_length());
+  string calculated = hash_to_hex_string(cur.data(), hasher->hash_length());
   if (calculated == root_hash) {
     return true;
   } else {
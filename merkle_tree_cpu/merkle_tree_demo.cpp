@@ -13,15 +13,34 @@ using namespace std;
 namespace fs = filesystem;
 
 int main(int argc, char *argv[]) {
-  // Hasher can be SHA_256 or MD_5 at the moment.
-  Hasher* hasher = new SHA_256();
+  // Hasher is SHA_256 unless --hash= picks another one; the option is taken
+  // out of argv before the positional arguments are read.
+  string hash_name = "sha256";
+  int num_args = 0;
+  for (int i = 0; i < argc; i++) {
+    if (strncmp(argv[i], "--hash=", 7) == 0) {
+      hash_name = argv[i] + 7;
+    } else {
+      argv[num_args++] = argv[i];
+    }
+  }
+  argc = num_args;
+  Hasher* hasher = new_hasher(hash_name);
+  if (hasher == nullptr) {
+    cerr << "Unknown hash " << hash_name
+         << "; use one of sha256, md5, blake3 and xxh3." << endl;
+    exit(1);
+  }
 
   BLOCK_SIZE = 1024;
   unsigned char* data;
   int data_len = 0;
+  fs::path p;
+  MappedFile* file = nullptr;
   if (argc == 1) {
     // no input file; use dummy data for demo.
-    cerr << "Usage: ./merkle_tree_demo <BLOCK_SIZE> <filename>" << endl;
+    cerr << "Usage: ./merkle_tree_demo [--hash=<name>] <BLOCK_SIZE> <filename>"
+         << endl;
     cerr << "For demo, create data filled with '9527' with " << BLOCK_SIZE * 4
          << " bytes." << endl;
     data = (unsigned char *)malloc(BLOCK_SIZE * 4 * sizeof(unsigned char));
@@ -33,21 +52,23 @@ int main(int argc, char *argv[]) {
   } else if (argc == 3) {
     BLOCK_SIZE = atoi(argv[1]);
     // input filepath provided
-    fs::path p{argv[2]};
+    p = argv[2];
     if (! fs::exists(p)) {
       cerr << "File not found at: " << fs::absolute(p) << endl;
       exit(2);
     }
-    // show file info and read into a buffer
+    // show file info and map it into memory instead of reading it
     cout << "path = " << fs::absolute(p) << endl;
     cout << "filesize = " << fs::file_size(p) << endl;
-    data_len = fs::file_size(p);
-    data = (unsigned char *)malloc(data_len * sizeof(unsigned char));
-    ifstream is;
-    is.open(p, ios::binary);
-    is.read((char*)data, data_len);
+    file = new MappedFile(p.string());
+    if (!file->is_open()) {
+      exit(2);
+    }
+    data_len = file->size();
+    data = file->data();
   } else {
-    cerr << "Usage: ./merkle_tree_demo <BLOCK_SIZE> <filename>" << endl;
+    cerr << "Usage: ./merkle_tree_demo [--hash=<name>] <BLOCK_SIZE> <filename>"
+         << endl;
     cerr << "Or ./merkle_tree_demo to demo with dummy data." << endl;
     exit(1);
   }
@@ -89,26 +110,184 @@ int main(int argc, char *argv[]) {
     cout << "Yeah! Verified!" << endl;
   }
 
-  /*
+  cout << "==== Verify all blocks as a client, in a batch ====" << endl;
+  vector<MerkleProof> proofs;
+  for (size_t i = 0; i < num_of_blocks(data_len); i++) {
+    proofs.push_back(merkle_tree.find_proof(i));
+  }
+  ThreadPool pool(thread::hardware_concurrency());
+  auto results = verify_proofs(proofs, merkle_tree.root->hash, hasher, pool);
+  if (count(results.begin(), results.end(), true) == (long)proofs.size()) {
+    cout << "Yeah! All " << proofs.size() << " blocks verified!" << endl;
+  }
+  if (!proofs[0].lrs.empty()) {
+    // tampered copies of a proof, after the valid one in the same batch
+    MerkleProof bad_siblings = proofs[0];
+    for (auto& byte : bad_siblings.sibling_hashes) {
+      byte ^= 0xff;
+    }
+    MerkleProof bad_sides = proofs[0];
+    for (auto& lr : bad_sides.lrs) {
+      lr = lr == LEFT ? RIGHT : LEFT;
+    }
+    vector<MerkleProof> tampered = {proofs[0], bad_siblings, bad_sides};
+    auto tampered_results =
+        verify_proofs(tampered, merkle_tree.root->hash, hasher, pool);
+    if (tampered_results[0] && !tampered_results[1] && !tampered_results[2]) {
+      cout << "Yeah! Tampered proofs rejected!" << endl;
+    } else {
+      cout << "Tampered proofs were not rejected!" << endl;
+      return 1;
+    }
+  }
+
+  cout << "==== Find the leaves two trees differ in ====" << endl;
+  {
+    // 37 blocks here, and the same with block 5 changed and 4 more blocks
+    // there: a diff of arity 2 fetches each of the 7 levels in one batch,
+    // and one of arity 4 each of the 4
+    const size_t block_size = 64;
+    vector<unsigned char> local_data(37 * block_size);
+    for (size_t i = 0; i < local_data.size(); i++) {
+      local_data[i] = i * 31 + i / block_size;
+    }
+    vector<unsigned char> remote_data(local_data);
+    remote_data.resize(41 * block_size, 7);
+    remote_data[5 * block_size + 3] ^= 1;
+    vector<pair<size_t, size_t>> expected = {{5, 6}, {37, 41}};
+    bool same = true;
+    for (auto [arity, round_trips] : {pair<unsigned int, size_t>{2, 7},
+                                      pair<unsigned int, size_t>{4, 4}}) {
+      TreeOptions options;
+      options.arity = arity;
+      options.block_size = block_size;
+      FlatMerkleTree local_tree(local_data.data(), local_data.size(), hasher,
+                                options);
+      FlatMerkleTree remote_tree(remote_data.data(), remote_data.size(),
+                                 hasher, options);
+      FlatTreeDigestSource local(local_tree);
+      FlatTreeDigestSource remote(remote_tree);
+      vector<pair<size_t, size_t>> ranges;
+      TreeDiffStats stats;
+      same = same && diff_trees(local, remote, ranges, &stats) &&
+             ranges == expected && stats.round_trips == round_trips;
+    }
+    if (same) {
+      cout << "Yeah! Found the leaves [5, 6) and [37, 41)!" << endl;
+    } else {
+      cout << "diff_trees() found other leaves!" << endl;
+      return 1;
+    }
+  }
+
+  cout << "==== Check the hashers against known digests ====" << endl;
+  {
+    // digests of the first len bytes of i % 251, the input of the BLAKE3
+    // test vectors, from the blake3 1.0.11 and xxhash 4.0.1 Python packages;
+    // the lengths reach every code path of both hashes
+    vector<unsigned char> input(102400);
+    for (size_t i = 0; i < input.size(); i++) {
+      input[i] = i % 251;
+    }
+    struct KnownDigest {
+      const char* hash_name;
+      int len;
+      const char* digest;
+    };
+    const KnownDigest known_digests[] = {
+      {"blake3", 0,
+       "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+      {"blake3", 1,
+       "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+      {"blake3", 1024,
+       "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+      {"blake3", 1025,
+       "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+      {"blake3", 31744,
+       "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47"},
+      {"blake3", 102400,
+       "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+      {"xxh3", 0, "99aa06d3014798d86001c324468d497f"},
+      {"xxh3", 3, "e3b55f57945a17cf5f4299fc161c9cbb"},
+      {"xxh3", 8, "e1e4432a62217fe4cfd50c61c8bb98c1"},
+      {"xxh3", 16, "72950631827607e2842812cc870dcae2"},
+      {"xxh3", 128, "14792fc3af88dc6c05321a0b64d67b41"},
+      {"xxh3", 240, "65b5be86da5540e7c92b68e16f83bbb6"},
+      {"xxh3", 241, "1da1cb61bcb8a2a102e8cd95421c6d02"},
+      {"xxh3", 1025, "2882ebca04ec915ce95c42288f28186e"},
+      {"xxh3", 102400, "ecd387d36185351b1428e17f1cac2837"},
+    };
+    bool known = true;
+    for (auto& known_digest : known_digests) {
+      unique_ptr<Hasher> known_hasher(new_hasher(known_digest.hash_name));
+      vector<unsigned char> digest(known_hasher->hash_length());
+      known_hasher->get_hash(input.data(), known_digest.len, digest.data());
+      known = known && hash_to_hex_string(digest.data(), digest.size()) ==
+                           known_digest.digest;
+    }
+    // the batched get_hash(), one SIMD lane per block for BLAKE3, must give
+    // the digests of the blocks one at a time
+    for (string hash_name : {"blake3", "xxh3"}) {
+      unique_ptr<Hasher> known_hasher(new_hasher(hash_name));
+      const int block_size = 1024, num_of_batched = 37;
+      size_t digest_len = known_hasher->hash_length();
+      vector<unsigned char> batched(num_of_batched * digest_len);
+      vector<unsigned char> digest(digest_len);
+      known_hasher->get_hash(input.data(), block_size, batched.data(),
+                             num_of_batched);
+      for (int i = 0; i < num_of_batched; i++) {
+        known_hasher->get_hash(input.data() + i * block_size, block_size,
+                               digest.data());
+        known = known && memcmp(digest.data(),
+                                batched.data() + i * digest_len,
+                                digest_len) == 0;
+      }
+    }
+    if (known) {
+      cout << "Yeah! BLAKE3 and XXH3-128 give the known digests!" << endl;
+    } else {
+      cout << "BLAKE3 or XXH3-128 gave a wrong digest!" << endl;
+      return 1;
+    }
+  }
+
+  cout << "==== Read in chunks ====" << endl;
+  // only one chunk and O(log n) subtree roots are in memory at a time
+  StreamingMerkleTree streaming_tree(hasher);
+  const int chunk_size = 64 * 1024;
+  if (p.empty()) {
+    for (int offset = 0; offset < data_len; offset += chunk_size) {
+      streaming_tree.update(data + offset, min(chunk_size, data_len - offset));
+    }
+  } else {
+    vector<unsigned char> chunk(chunk_size);
+    ifstream is(p, ios::binary);
+    while (is.read((char*)chunk.data(), chunk_size) || is.gcount() > 0) {
+      streaming_tree.update(chunk.data(), is.gcount());
+    }
+  }
+  cout << "Root hash: " << streaming_tree.root_hash() << endl;
+  if (streaming_tree.root_hash() == root_hash) {
+    cout << "Yeah! Same root hash!" << endl;
+  }
 
   // split input data into two halves; the second half is appended later.
-  int num_of_blocks = ceil((double)data_len / BLOCK_SIZE);
-  if (num_of_blocks > 1) {
-    int first_size = BLOCK_SIZE * (num_of_blocks / 2);
-    Blocks old_blocks(data, first_size);
-    MerkleTree merkle_tree_to_append(old_blocks);
+  int num_of_leaves = num_of_blocks(data_len);
+  if (num_of_leaves > 1) {
+    int first_size = BLOCK_SIZE * (num_of_leaves / 2);
+    MerkleTree merkle_tree_to_append(data, first_size, hasher);
     cout << "===== Read half first, and append the other half. =====" << endl;
     cout << "=== Merkle Tree of the first half ===" << endl;
     merkle_tree_to_append.print();
 
-    Blocks new_blocks(data + first_size, data_len - first_size);
-    merkle_tree_to_append.append(new_blocks);
+    merkle_tree_to_append.append(data + first_size, data_len - first_size);
     cout << "=== Merkle Tree of the first half + the second half ===" << endl;
     merkle_tree_to_append.print();
+    if (merkle_tree_to_append.root_hash() == root_hash) {
+      cout << "Yeah! Same root hash!" << endl;
+    }
   }
 
-  */
-
   // For debugging
   // To print merkle tree of a specific TestData(10000,100)
   #if 0
@@ -123,6 +302,7 @@ int main(int argc, char *argv[]) {
   mt.print();
   #endif
 
+  delete file;
   delete hasher;
 
   return 0;
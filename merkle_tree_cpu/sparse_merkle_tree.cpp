@@ -0,0 +1,528 @@
+#include <algorithm>
+#include "../merkle_tree.hpp"
+
+using namespace std;
+
+namespace {
+
+const size_t kKeyLen = SparseMerkleTree::kKeyLen;
+const size_t kKeyBits = SparseMerkleTree::kKeyBits;
+// the nodes of one depth are rehashed on all threads from this many on, in
+// batches of at most kRehashBatch
+const size_t kMinParallelNodes = 1024;
+const size_t kRehashBatch = 4096;
+
+// bit of key, counting from the most significant bit of its first byte, so
+// that keys sorted as bytes are sorted as paths from the root
+bool key_bit(const unsigned char* key, size_t bit) {
+  return (key[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+// the first bit where two keys differ, or kKeyBits if they are the same
+size_t first_diff_bit(const unsigned char* a, const unsigned char* b) {
+  for (size_t i = 0; i < kKeyLen; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x != y) {
+      return i * 8 + __builtin_clzll(__builtin_bswap64(x ^ y));
+    }
+  }
+  return kKeyBits;
+}
+
+bool key_less(const unsigned char* a, const unsigned char* b) {
+  return memcmp(a, b, kKeyLen) < 0;
+}
+
+// a buffer big enough for what any digest below is hashed from
+size_t buffer_len(unsigned int digest_len) {
+  return 1 + kKeyLen + 2 * digest_len;
+}
+
+// H(left | right); digest may be left or right
+void pair_digest(Hasher* hasher, const unsigned char* left,
+                 const unsigned char* right, unsigned char* buffer,
+                 unsigned char* digest) {
+  unsigned int digest_len = hasher->hash_length();
+  memcpy(buffer, left, digest_len);
+  memcpy(buffer + digest_len, right, digest_len);
+  hasher->get_hash(buffer, digest_len * 2, digest);
+}
+
+size_t leaf_input_len(unsigned int digest_len) {
+  return 1 + kKeyLen + digest_len;
+}
+
+// a leaf is H(0x00 | key | value_hash). Its prefix and length keep it apart
+// from the digest of a node, H(left | right), so a leaf cannot pass for a
+// subtree.
+void leaf_input(const unsigned char* key, const unsigned char* value_hash,
+                unsigned int digest_len, unsigned char* input) {
+  input[0] = 0;
+  memcpy(input + 1, key, kKeyLen);
+  memcpy(input + 1 + kKeyLen, value_hash, digest_len);
+}
+
+void leaf_digest(Hasher* hasher, const unsigned char* key,
+                 const unsigned char* value_hash, unsigned char* buffer,
+                 unsigned char* digest) {
+  unsigned int digest_len = hasher->hash_length();
+  leaf_input(key, value_hash, digest_len, buffer);
+  hasher->get_hash(buffer, leaf_input_len(digest_len), digest);
+}
+
+// H(0x01 | height), two bytes of it, so the verifier works out the one it
+// needs with a single hash
+void empty_digest_of(Hasher* hasher, size_t height, unsigned char* buffer,
+                     unsigned char* digest) {
+  buffer[0] = 1;
+  buffer[1] = height >> 8;
+  buffer[2] = height & 0xff;
+  hasher->get_hash(buffer, 3, digest);
+}
+
+} // namespace
+
+//
+// Class SparseMerkleTree
+//
+
+SparseMerkleTree::SparseMerkleTree(Hasher* hasher_)
+    : SparseMerkleTree(hasher_, 1) {}
+
+SparseMerkleTree::SparseMerkleTree(Hasher* hasher_, unsigned int num_threads)
+    : hasher(hasher_), digest_len(hasher_->hash_length()),
+      pool(max(num_threads, 1u)),
+      empty_digests((kKeyBits + 1) * hasher_->hash_length()),
+      dirty(kKeyBits + 1) {
+  vector<unsigned char> buffer(buffer_len(digest_len));
+  for (size_t height = 0; height <= kKeyBits; height++) {
+    empty_digest_of(hasher, height, buffer.data(),
+                    empty_digests.data() + height * digest_len);
+  }
+}
+
+unsigned char* SparseMerkleTree::node_digest(uint32_t node) {
+  return digests.data() + (size_t)node * 2 * digest_len;
+}
+
+unsigned char* SparseMerkleTree::top_digest(uint32_t node) {
+  return digests.data() + ((size_t)node * 2 + 1) * digest_len;
+}
+
+const unsigned char* SparseMerkleTree::empty_digest(size_t height) const {
+  return empty_digests.data() + height * digest_len;
+}
+
+uint32_t SparseMerkleTree::new_node() {
+  if (!free_nodes.empty()) {
+    uint32_t node = free_nodes.back();
+    free_nodes.pop_back();
+    return node;
+  }
+  nodes.emplace_back();
+  digests.resize(nodes.size() * 2 * digest_len);
+  return nodes.size() - 1;
+}
+
+// a leaf for the key of batch entry entry
+uint32_t SparseMerkleTree::new_leaf(size_t entry, size_t top) {
+  uint32_t leaf = new_node();
+  Node& node = nodes[leaf];
+  memcpy(node.key, batch_keys[entry], kKeyLen);
+  node.children[0] = node.children[1] = kNoNode;
+  node.bit = kKeyBits;
+  node.top = top;
+  memcpy(node_digest(leaf), batch_value_hashes.data() + entry * digest_len,
+         digest_len);
+  dirty[kKeyBits].push_back(leaf);
+  num_of_keys++;
+  return leaf;
+}
+
+// a subtree at depth top of the batch entries [lo, hi) and of leaf, if there
+// is one; its key is not in the batch, and all of them share the bits before
+// top
+uint32_t SparseMerkleTree::build(size_t top, size_t lo, size_t hi,
+                                 uint32_t leaf) {
+  if (hi - lo + (leaf != kNoNode) == 1) {
+    if (leaf != kNoNode) {
+      nodes[leaf].top = top;
+      return leaf;
+    }
+    return new_leaf(lo, top);
+  }
+  const unsigned char* first = batch_keys[lo];
+  const unsigned char* last = batch_keys[hi - 1];
+  uint32_t sides[2] = {kNoNode, kNoNode};
+  if (leaf != kNoNode) {
+    const unsigned char* key = nodes[leaf].key;
+    first = key_less(key, first) ? key : first;
+    last = key_less(last, key) ? key : last;
+  }
+  // the first and last keys differ first where any of them do
+  size_t bit = first_diff_bit(first, last);
+  if (leaf != kNoNode) {
+    sides[key_bit(nodes[leaf].key, bit)] = leaf;
+  }
+  size_t mid = partition_point(batch_keys.begin() + lo,
+                               batch_keys.begin() + hi,
+                               [bit](const unsigned char* key) {
+                                 return !key_bit(key, bit);
+                               }) - batch_keys.begin();
+  uint32_t left = build(bit + 1, lo, mid, sides[0]);
+  uint32_t right = build(bit + 1, mid, hi, sides[1]);
+  uint32_t parent = new_node();
+  Node& node = nodes[parent];
+  memcpy(node.key, nodes[left].key, kKeyLen);
+  node.children[0] = left;
+  node.children[1] = right;
+  node.bit = bit;
+  node.top = top;
+  dirty[bit].push_back(parent);
+  return parent;
+}
+
+// merge the batch entries [lo, hi) into the subtree of node, which is now at
+// depth top, and return the subtree
+uint32_t SparseMerkleTree::merge(uint32_t node, size_t top, size_t lo,
+                                 size_t hi) {
+  if (node == kNoNode) {
+    return build(top, lo, hi, kNoNode);
+  }
+  size_t bit = nodes[node].bit;
+  if (lo == hi) {
+    // moved down under a new node: only the levels above it change
+    nodes[node].top = top;
+    if (bit != kKeyBits) {
+      dirty[bit].push_back(node);
+    }
+    return node;
+  }
+  if (bit == kKeyBits) {
+    const unsigned char* key = nodes[node].key;
+    auto it = lower_bound(batch_keys.begin() + lo, batch_keys.begin() + hi,
+                          key, key_less);
+    if (it == batch_keys.begin() + hi || memcmp(*it, key, kKeyLen) != 0) {
+      return build(top, lo, hi, node);
+    }
+    if (hi - lo == 1) {
+      memcpy(node_digest(node), batch_value_hashes.data() + lo * digest_len,
+             digest_len);
+      nodes[node].top = top;
+      dirty[kKeyBits].push_back(node);
+      return node;
+    }
+    // the batch has the key too, and its new value
+    free_nodes.push_back(node);
+    num_of_keys--;
+    return build(top, lo, hi, kNoNode);
+  }
+
+  const unsigned char* key = nodes[node].key;
+  size_t split = min(first_diff_bit(key, batch_keys[lo]),
+                     first_diff_bit(key, batch_keys[hi - 1]));
+  if (split < bit) {
+    // some keys leave the path to the node before it splits: a new node
+    // above it splits them off
+    size_t mid = partition_point(batch_keys.begin() + lo,
+                                 batch_keys.begin() + hi,
+                                 [split](const unsigned char* k) {
+                                   return !key_bit(k, split);
+                                 }) - batch_keys.begin();
+    bool side = key_bit(key, split);
+    uint32_t children[2];
+    children[side] = side ? merge(node, split + 1, mid, hi)
+                          : merge(node, split + 1, lo, mid);
+    children[!side] = side ? build(split + 1, lo, mid, kNoNode)
+                           : build(split + 1, mid, hi, kNoNode);
+    uint32_t parent = new_node();
+    Node& new_parent = nodes[parent];
+    memcpy(new_parent.key, nodes[node].key, kKeyLen);
+    new_parent.children[0] = children[0];
+    new_parent.children[1] = children[1];
+    new_parent.bit = split;
+    new_parent.top = top;
+    dirty[split].push_back(parent);
+    return parent;
+  }
+  size_t mid = partition_point(batch_keys.begin() + lo,
+                               batch_keys.begin() + hi,
+                               [bit](const unsigned char* k) {
+                                 return !key_bit(k, bit);
+                               }) - batch_keys.begin();
+  if (lo < mid) {
+    uint32_t child = merge(nodes[node].children[0], bit + 1, lo, mid);
+    nodes[node].children[0] = child;
+  }
+  if (mid < hi) {
+    uint32_t child = merge(nodes[node].children[1], bit + 1, mid, hi);
+    nodes[node].children[1] = child;
+  }
+  nodes[node].top = top;
+  dirty[bit].push_back(node);
+  return node;
+}
+
+// hash digest, the subtree of node at depth node.bit, up to depth top past
+// the levels where the other side is empty
+void SparseMerkleTree::carry(const Node& node, size_t top,
+                             unsigned char* digest,
+                             unsigned char* buffer) const {
+  for (size_t depth = node.bit; depth-- > top;) {
+    const unsigned char* empty = empty_digest(kKeyBits - depth - 1);
+    if (key_bit(node.key, depth)) {
+      pair_digest(hasher, empty, digest, buffer, digest);
+    } else {
+      pair_digest(hasher, digest, empty, buffer, digest);
+    }
+  }
+}
+
+// the digests of a run of nodes of one bit whose children are hashed
+// already, hashed as one batch
+void SparseMerkleTree::rehash(const uint32_t* run, size_t count, size_t bit) {
+  size_t input_len =
+      bit == kKeyBits ? leaf_input_len(digest_len) : 2 * digest_len;
+  vector<unsigned char> inputs(count * input_len);
+  vector<unsigned char> outputs(count * digest_len);
+  for (size_t i = 0; i < count; i++) {
+    const Node& n = nodes[run[i]];
+    unsigned char* input = inputs.data() + i * input_len;
+    if (bit == kKeyBits) {
+      leaf_input(n.key, node_digest(run[i]), digest_len, input);
+    } else {
+      memcpy(input, top_digest(n.children[0]), digest_len);
+      memcpy(input + digest_len, top_digest(n.children[1]), digest_len);
+    }
+  }
+  hasher->get_hash(inputs.data(), input_len, outputs.data(), count);
+  for (size_t i = 0; i < count; i++) {
+    const Node& n = nodes[run[i]];
+    unsigned char* output = outputs.data() + i * digest_len;
+    unsigned char* top = top_digest(run[i]);
+    memcpy(top, output, digest_len);
+    if (bit != kKeyBits) {
+      memcpy(node_digest(run[i]), output, digest_len);
+      carry(n, n.top, top, inputs.data());
+    }
+  }
+}
+
+void SparseMerkleTree::update(vector<SparseUpdate>& updates) {
+  if (updates.empty()) {
+    return;
+  }
+  // sort by the first 8 bytes of the keys, kept next to the index, so that
+  // most comparisons do not touch the updates
+  vector<pair<uint64_t, size_t>> order(updates.size());
+  for (size_t i = 0; i < updates.size(); i++) {
+    uint64_t prefix;
+    memcpy(&prefix, updates[i].key, 8);
+    order[i] = {__builtin_bswap64(prefix), i};
+  }
+  sort(order.begin(), order.end(),
+       [&](const pair<uint64_t, size_t>& a, const pair<uint64_t, size_t>& b) {
+         if (a.first != b.first) {
+           return a.first < b.first;
+         }
+         int cmp = memcmp(updates[a.second].key, updates[b.second].key,
+                          kKeyLen);
+         return cmp != 0 ? cmp < 0 : a.second < b.second;
+       });
+  // of the updates of one key, keep the last
+  size_t num_of_entries = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    if (i + 1 < order.size() && order[i].first == order[i + 1].first &&
+        memcmp(updates[order[i].second].key, updates[order[i + 1].second].key,
+               kKeyLen) == 0) {
+      continue;
+    }
+    order[num_of_entries++] = order[i];
+  }
+  order.resize(num_of_entries);
+
+  // the keys back to back in order, for the merge to search
+  vector<unsigned char> sorted_keys(num_of_entries * kKeyLen);
+  batch_keys.resize(num_of_entries);
+  batch_value_hashes.resize(num_of_entries * digest_len);
+  for (size_t i = 0; i < num_of_entries; i++) {
+    memcpy(sorted_keys.data() + i * kKeyLen, updates[order[i].second].key,
+           kKeyLen);
+    batch_keys[i] = sorted_keys.data() + i * kKeyLen;
+  }
+  pool.parallel_for(num_of_entries, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const SparseUpdate& u = updates[order[i].second];
+      hasher->get_hash(u.value, u.value_len,
+                       batch_value_hashes.data() + i * digest_len);
+    }
+  });
+
+  root_node = merge(root_node, 0, 0, num_of_entries);
+
+  // the children of a node split deeper than it, so the nodes of each bit
+  // only need those of the bits after it
+  for (size_t bit = kKeyBits + 1; bit-- > 0;) {
+    vector<uint32_t>& level = dirty[bit];
+    auto rehash_range = [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i += kRehashBatch) {
+        rehash(level.data() + i, min(kRehashBatch, end - i), bit);
+      }
+    };
+    if (level.size() >= kMinParallelNodes) {
+      pool.parallel_for(level.size(), rehash_range);
+    } else {
+      rehash_range(0, level.size());
+    }
+    level.clear();
+  }
+  batch_keys.clear();
+  batch_value_hashes.clear();
+}
+
+void SparseMerkleTree::update(const unsigned char* key, unsigned char* value,
+                              int value_len) {
+  vector<SparseUpdate> updates(1);
+  memcpy(updates[0].key, key, kKeyLen);
+  updates[0].value = value;
+  updates[0].value_len = value_len;
+  update(updates);
+}
+
+bool SparseMerkleTree::find(const unsigned char* key,
+                            unsigned char* value_hash) const {
+  uint32_t node = root_node;
+  while (node != kNoNode && nodes[node].bit != kKeyBits) {
+    node = nodes[node].children[key_bit(key, nodes[node].bit)];
+  }
+  if (node == kNoNode || memcmp(nodes[node].key, key, kKeyLen) != 0) {
+    return false;
+  }
+  memcpy(value_hash, digests.data() + (size_t)node * 2 * digest_len,
+         digest_len);
+  return true;
+}
+
+SparseMerkleProof SparseMerkleTree::find_proof(const unsigned char* key) const {
+  SparseMerkleProof proof;
+  vector<unsigned char> buffer(buffer_len(digest_len));
+  size_t depth = 0;
+  for (uint32_t i = root_node; i != kNoNode;) {
+    const Node& node = nodes[i];
+    const unsigned char* digest = digests.data() + (size_t)i * 2 * digest_len;
+    if (node.bit == kKeyBits) {
+      proof.leaf_key.assign(node.key, node.key + kKeyLen);
+      proof.leaf_value_hash.assign(digest, digest + digest_len);
+      break;
+    }
+    // down to where the node splits, the side away from it is empty
+    size_t split = min<size_t>(first_diff_bit(node.key, key), node.bit);
+    for (; depth < split; depth++) {
+      proof.empty_siblings.push_back(true);
+    }
+    if (split < node.bit) {
+      // the key leaves the path to the node, whose subtree is the sibling
+      // of the empty one it goes to
+      vector<unsigned char> sibling(digest, digest + digest_len);
+      carry(node, split + 1, sibling.data(), buffer.data());
+      proof.empty_siblings.push_back(false);
+      proof.sibling_hashes.insert(proof.sibling_hashes.end(),
+                                  sibling.begin(), sibling.end());
+      break;
+    }
+    bool side = key_bit(key, node.bit);
+    const unsigned char* sibling =
+        digests.data() + ((size_t)node.children[!side] * 2 + 1) * digest_len;
+    proof.empty_siblings.push_back(false);
+    proof.sibling_hashes.insert(proof.sibling_hashes.end(), sibling,
+                                sibling + digest_len);
+    i = node.children[side];
+    depth = node.bit + 1;
+  }
+  return proof;
+}
+
+void SparseMerkleTree::root(unsigned char* root_hash) const {
+  const unsigned char* digest =
+      root_node == kNoNode
+          ? empty_digest(kKeyBits)
+          : digests.data() + ((size_t)root_node * 2 + 1) * digest_len;
+  memcpy(root_hash, digest, digest_len);
+}
+
+string SparseMerkleTree::root_hash() const {
+  vector<unsigned char> digest(digest_len);
+  root(digest.data());
+  return hash_to_hex_string(digest.data(), digest_len);
+}
+
+size_t SparseMerkleTree::size() const { return num_of_keys; }
+
+//
+// Sparse proofs
+//
+
+bool verify_sparse_proof(const SparseMerkleProof& proof,
+                         const unsigned char* key,
+                         const unsigned char* value_hash,
+                         unsigned char* root_hash, Hasher* hasher) {
+  unsigned int digest_len = hasher->hash_length();
+  size_t path_len = proof.empty_siblings.size();
+  size_t num_of_siblings = count(proof.empty_siblings.begin(),
+                                 proof.empty_siblings.end(), false);
+  if (path_len > kKeyBits ||
+      proof.sibling_hashes.size() != num_of_siblings * digest_len) {
+    return false;
+  }
+  vector<unsigned char> buffer(buffer_len(digest_len));
+  vector<unsigned char> digest(digest_len);
+  if (proof.leaf_key.empty()) {
+    // the path ends at an empty subtree
+    if (value_hash != nullptr || !proof.leaf_value_hash.empty()) {
+      return false;
+    }
+    empty_digest_of(hasher, kKeyBits - path_len, buffer.data(),
+                    digest.data());
+  } else {
+    if (proof.leaf_key.size() != kKeyLen ||
+        proof.leaf_value_hash.size() != digest_len) {
+      return false;
+    }
+    const unsigned char* leaf_key = proof.leaf_key.data();
+    if (value_hash != nullptr) {
+      if (memcmp(leaf_key, key, kKeyLen) != 0 ||
+          memcmp(proof.leaf_value_hash.data(), value_hash, digest_len) != 0) {
+        return false;
+      }
+    } else if (first_diff_bit(leaf_key, key) < path_len ||
+               memcmp(leaf_key, key, kKeyLen) == 0) {
+      // the leaf of another key, on the path of this one
+      return false;
+    }
+    leaf_digest(hasher, leaf_key, proof.leaf_value_hash.data(), buffer.data(),
+                digest.data());
+  }
+
+  vector<unsigned char> empty(digest_len);
+  const unsigned char* sibling =
+      proof.sibling_hashes.data() + proof.sibling_hashes.size();
+  for (size_t depth = path_len; depth-- > 0;) {
+    const unsigned char* other;
+    if (proof.empty_siblings[depth]) {
+      empty_digest_of(hasher, kKeyBits - depth - 1, buffer.data(),
+                      empty.data());
+      other = empty.data();
+    } else {
+      sibling -= digest_len;
+      other = sibling;
+    }
+    if (key_bit(key, depth)) {
+      pair_digest(hasher, other, digest.data(), buffer.data(), digest.data());
+    } else {
+      pair_digest(hasher, digest.data(), other, buffer.data(), digest.data());
+    }
+  }
+  return memcmp(digest.data(), root_hash, digest_len) == 0;
+}
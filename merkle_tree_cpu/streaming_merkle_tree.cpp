@@ -0,0 +1,143 @@
+#include <algorithm>
+#include "../merkle_tree.hpp"
+
+using namespace std;
+
+//
+// Class StreamingMerkleTree
+//
+
+// Leaves are added like a binary counter: a new leaf merges with the pending
+// subtree of the same size, and the result carries up to the next level.
+// Since MerkleTree pairs nodes from the left and carries orphans up, every
+// full subtree of 2^l leaves is final as soon as it is complete.
+// hash is overwritten as a scratch buffer.
+void StreamingMerkleTree::add_leaf_hash(unsigned char* hash) {
+  unsigned char* lhs = pair_buffer.data();
+  unsigned char* rhs = pair_buffer.data() + digest_len;
+  memcpy(rhs, hash, digest_len);
+  unsigned int level = 0;
+  while (leaf_count & (1ULL << level)) {
+    memcpy(lhs, frontier.data() + level * digest_len, digest_len);
+    hasher->get_hash(pair_buffer.data(), digest_len * 2, hash);
+    memcpy(rhs, hash, digest_len);
+    level++;
+  }
+  if (frontier.size() < (level + 1) * digest_len) {
+    frontier.resize((level + 1) * digest_len);
+  }
+  memcpy(frontier.data() + level * digest_len, rhs, digest_len);
+  leaf_count++;
+}
+
+StreamingMerkleTree::StreamingMerkleTree(Hasher* hasher_)
+    : StreamingMerkleTree(hasher_, 1) {}
+
+StreamingMerkleTree::StreamingMerkleTree(Hasher* hasher_,
+                                         unsigned int num_threads)
+    : StreamingMerkleTree(hasher_, num_threads, BLOCK_SIZE) {}
+
+StreamingMerkleTree::StreamingMerkleTree(Hasher* hasher_,
+                                         unsigned int num_threads,
+                                         size_t block_size_)
+    : hasher(hasher_), digest_len(hasher_->hash_length()),
+      pool(max(num_threads, 1u)), block_len(max<size_t>(block_size_, 1)),
+      leaf_count(0), pair_buffer(digest_len * 2) {
+  partial_block.reserve(block_len);
+}
+
+// feed the next data_len bytes
+void StreamingMerkleTree::update(unsigned char* data, size_t data_len) {
+  // complete the partial block first
+  if (!partial_block.empty()) {
+    size_t to_copy = min(data_len, block_len - partial_block.size());
+    partial_block.insert(partial_block.end(), data, data + to_copy);
+    data += to_copy;
+    data_len -= to_copy;
+    if (partial_block.size() < block_len) {
+      return;
+    }
+    vector<unsigned char> hash(digest_len);
+    hasher->get_hash(partial_block.data(), block_len, hash.data());
+    add_leaf_hash(hash.data());
+    partial_block.clear();
+  }
+
+  // hash the full blocks in place, then keep the remainder for later
+  size_t num_of_full_blocks = data_len / block_len;
+  if (num_of_full_blocks > 0) {
+    vector<unsigned char> hashes(num_of_full_blocks * digest_len);
+    hash_blocks(data, num_of_full_blocks * block_len, block_len, hasher,
+                hashes.data(), pool);
+    for (size_t i = 0; i < num_of_full_blocks; i++) {
+      add_leaf_hash(hashes.data() + i * digest_len);
+    }
+  }
+  size_t offset = num_of_full_blocks * block_len;
+  partial_block.insert(partial_block.end(), data + offset, data + data_len);
+}
+
+// add leaves hashed elsewhere, as if their blocks were fed with update()
+bool StreamingMerkleTree::add_leaf_hashes(unsigned char* hashes,
+                                          size_t num_of_hashes) {
+  if (!partial_block.empty()) {
+    return false;
+  }
+  vector<unsigned char> hash(digest_len);
+  for (size_t i = 0; i < num_of_hashes; i++) {
+    memcpy(hash.data(), hashes + i * digest_len, digest_len);
+    add_leaf_hash(hash.data());
+  }
+  return true;
+}
+
+// fold the pending subtrees from the smallest one up into the root
+void StreamingMerkleTree::finalize(unsigned char* root) {
+  vector<unsigned char> saved_frontier(frontier);
+  unsigned long long saved_leaf_count = leaf_count;
+  // the partial block is the last leaf, but only for this root
+  if (!partial_block.empty()) {
+    vector<unsigned char> last_block(partial_block);
+    last_block.resize(block_len, 0);
+    vector<unsigned char> hash(digest_len);
+    hasher->get_hash(last_block.data(), block_len, hash.data());
+    add_leaf_hash(hash.data());
+  }
+
+  unsigned char* lhs = pair_buffer.data();
+  unsigned char* rhs = pair_buffer.data() + digest_len;
+  bool found = false;
+  for (unsigned int level = 0; (leaf_count >> level) > 0; level++) {
+    if ((leaf_count & (1ULL << level)) == 0) {
+      continue;
+    }
+    unsigned char* subtree = frontier.data() + level * digest_len;
+    if (!found) {
+      memcpy(root, subtree, digest_len);
+      found = true;
+    } else {
+      memcpy(lhs, subtree, digest_len);
+      memcpy(rhs, root, digest_len);
+      hasher->get_hash(pair_buffer.data(), digest_len * 2, root);
+    }
+  }
+  frontier.swap(saved_frontier);
+  leaf_count = saved_leaf_count;
+}
+
+// return the root hash in hex string format, or "" if nothing was fed
+string StreamingMerkleTree::root_hash() {
+  if (leaf_count == 0 && partial_block.empty()) {
+    return "";
+  }
+  vector<unsigned char> root(digest_len);
+  finalize(root.data());
+  return hash_to_hex_string(root.data(), digest_len);
+}
+
+// number of leaves so far, counting the partial block
+unsigned long long StreamingMerkleTree::num_of_leaves() const {
+  return leaf_count + (partial_block.empty() ? 0 : 1);
+}
+
+size_t StreamingMerkleTree::block_size() const { return block_len; }
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include "../merkle_tree.hpp"
+
+using namespace std;
+
+namespace {
+
+// add the leaves [first, last) to ranges, merging them into the last range
+// if they follow it
+void add_range(vector<pair<size_t, size_t>>& ranges, size_t first,
+               size_t last) {
+  if (!ranges.empty() && ranges.back().second == first) {
+    ranges.back().second = last;
+  } else {
+    ranges.push_back({first, last});
+  }
+}
+
+} // namespace
+
+//
+// Class FlatTreeDigestSource
+//
+
+FlatTreeDigestSource::FlatTreeDigestSource(FlatMerkleTree& tree_)
+    : tree(tree_) {}
+
+HasherId FlatTreeDigestSource::hasher_id() { return tree.hasher->id(); }
+
+unsigned int FlatTreeDigestSource::digest_length() { return tree.digest_len; }
+
+unsigned int FlatTreeDigestSource::arity() { return tree.arity(); }
+
+size_t FlatTreeDigestSource::num_of_leaves() { return tree.num_of_leaves(); }
+
+bool FlatTreeDigestSource::fetch_digests(size_t level,
+                                         const vector<size_t>& indices,
+                                         unsigned char* digests) {
+  for (size_t i = 0; i < indices.size(); i++) {
+    if (indices[i] >= tree.level_size(level)) {
+      return false;
+    }
+    memcpy(digests + i * tree.digest_len, tree.node_hash(level, indices[i]),
+           tree.digest_len);
+  }
+  return true;
+}
+
+//
+// Class MerkleTreeDigestSource
+//
+
+MerkleTreeDigestSource::MerkleTreeDigestSource(MerkleTree& tree_)
+    : tree(tree_) {}
+
+HasherId MerkleTreeDigestSource::hasher_id() { return tree.hasher->id(); }
+
+unsigned int MerkleTreeDigestSource::digest_length() {
+  return tree.hasher->hash_length();
+}
+
+unsigned int MerkleTreeDigestSource::arity() { return 2; }
+
+size_t MerkleTreeDigestSource::num_of_leaves() {
+  return tree.levels.empty() ? 0 : tree.levels[0].size();
+}
+
+// the levels of a MerkleTree have the shape of a binary FlatMerkleTree, an
+// orphan carried up appearing on both levels
+bool MerkleTreeDigestSource::fetch_digests(size_t level,
+                                           const vector<size_t>& indices,
+                                           unsigned char* digests) {
+  unsigned int digest_len = tree.hasher->hash_length();
+  for (size_t i = 0; i < indices.size(); i++) {
+    if (level >= tree.levels.size() ||
+        indices[i] >= tree.levels[level].size()) {
+      return false;
+    }
+    memcpy(digests + i * digest_len, tree.levels[level][indices[i]]->hash,
+           digest_len);
+  }
+  return true;
+}
+
+//
+// Tree comparison
+//
+
+// Node j of level l covers the leaves [j k^l, (j + 1) k^l) in any tree of
+// arity k, cut short at the last leaf, so the nodes at the same place in two
+// trees of different sizes cover the same leaves as long as both trees have
+// all of them. Only such nodes are compared; the leaves past the smaller
+// tree differ anyway.
+bool diff_trees(TreeDigestSource& local, TreeDigestSource& remote,
+                vector<pair<size_t, size_t>>& ranges, TreeDiffStats* stats) {
+  ranges.clear();
+  size_t local_leaves = local.num_of_leaves();
+  size_t remote_leaves = remote.num_of_leaves();
+  size_t common = min(local_leaves, remote_leaves);
+  size_t all = max(local_leaves, remote_leaves);
+  unsigned int k = local.arity();
+  unsigned int digest_len = local.digest_length();
+  if (local.hasher_id() != remote.hasher_id() ||
+      digest_len != remote.digest_length() || k != remote.arity() || k < 2) {
+    common = 0;
+  }
+  if (common == 0) {
+    if (all > 0) {
+      ranges.push_back({0, all});
+    }
+    return true;
+  }
+
+  size_t top = min(num_of_levels(local_leaves, k),
+                   num_of_levels(remote_leaves, k)) - 1;
+  // leaves covered by a node of the current level
+  size_t span = 1;
+  for (size_t level = 0; level < top; level++) {
+    span *= k;
+  }
+  vector<size_t> indices((common + span - 1) / span);
+  for (size_t i = 0; i < indices.size(); i++) {
+    indices[i] = i;
+  }
+  vector<unsigned char> local_digests;
+  vector<unsigned char> remote_digests;
+  vector<size_t> next;
+  for (size_t level = top + 1; level-- > 0;) {
+    local_digests.resize(indices.size() * digest_len);
+    remote_digests.resize(indices.size() * digest_len);
+    if (!local.fetch_digests(level, indices, local_digests.data()) ||
+        !remote.fetch_digests(level, indices, remote_digests.data())) {
+      ranges.clear();
+      return false;
+    }
+    if (stats != nullptr) {
+      stats->round_trips++;
+      stats->digests_fetched += indices.size();
+    }
+    // descend into the children of the differing nodes that cover common
+    // leaves
+    next.clear();
+    for (size_t i = 0; i < indices.size(); i++) {
+      if (memcmp(local_digests.data() + i * digest_len,
+                 remote_digests.data() + i * digest_len, digest_len) == 0) {
+        continue;
+      }
+      if (level == 0) {
+        add_range(ranges, indices[i], indices[i] + 1);
+        continue;
+      }
+      size_t child_span = span / k;
+      for (size_t child = indices[i] * k;
+           child < (indices[i] + 1) * k && child * child_span < common;
+           child++) {
+        next.push_back(child);
+      }
+    }
+    if (next.empty() && level > 0) {
+      break;
+    }
+    indices.swap(next);
+    span /= k;
+  }
+  if (common < all) {
+    add_range(ranges, common, all);
+  }
+  return true;
+}
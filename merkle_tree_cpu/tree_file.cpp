@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include "../merkle_tree.hpp"
+
+using namespace std;
+
+// A tree file holds all levels of a tree in the layout of FlatMerkleTree, so
+// it is used in place once mapped:
+//   TreeFileHeader
+//   the digests of all levels back to back, leaves first
+//   zero padding up to a multiple of 8 bytes
+//   the leaf indices sorted by their digests, 8 bytes each
+//   the end offsets of the leaves in the data, 8 bytes each, only for
+//   content-defined leaves
+// All integers are in the byte order of the machine that wrote the file.
+
+namespace {
+
+const char kTreeFileMagic[8] = {'M', 'R', 'K', 'L', 'T', 'R', 'E', 'E'};
+// bump whenever the layout changes; files of other versions are rejected
+const uint32_t kTreeFileVersion = 3;
+// read back in another byte order, this is 0x04030201
+const uint32_t kTreeFileByteOrder = 0x01020304;
+
+struct TreeFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t hasher_id;
+  uint32_t digest_len;
+  uint32_t arity;
+  uint32_t reserved;
+  uint64_t block_size;
+  // the ChunkingParams of content-defined leaves, all 0 for blocks
+  uint64_t min_chunk_size;
+  uint64_t avg_chunk_size;
+  uint64_t max_chunk_size;
+  uint64_t num_of_leaves;
+  uint64_t nodes_offset;
+  uint64_t leaves_offset;
+  // 0 for blocks
+  uint64_t chunk_ends_offset;
+  uint64_t file_size;
+};
+
+static_assert(sizeof(TreeFileHeader) == 104, "TreeFileHeader is 104 bytes");
+// the sorted leaf indices and the chunk ends are used in place as size_t
+static_assert(sizeof(size_t) == sizeof(uint64_t), "size_t is 64 bits");
+
+// fill in the layout of the file of a tree of num_of_leaves leaves of
+// block_size bytes, or cut with chunking if it is set, and arity children
+// per parent; returns false if the sizes overflow
+bool make_header(TreeFileHeader& header, unsigned int hasher_id,
+                 unsigned int digest_len, unsigned int arity,
+                 size_t block_size, const ChunkingParams* chunking,
+                 size_t num_of_leaves) {
+  if (arity < 2 || block_size == 0 ||
+      (chunking != nullptr && chunking->avg_size == 0)) {
+    return false;
+  }
+  size_t num_of_nodes = 0;
+  for (size_t size = num_of_leaves; size > 0;
+       size = num_of_blocks(size, arity)) {
+    num_of_nodes += size;
+    if (size == 1) {
+      break;
+    }
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kTreeFileMagic, sizeof(header.magic));
+  header.version = kTreeFileVersion;
+  header.byte_order = kTreeFileByteOrder;
+  header.hasher_id = hasher_id;
+  header.digest_len = digest_len;
+  header.arity = arity;
+  header.block_size = block_size;
+  if (chunking != nullptr) {
+    header.min_chunk_size = chunking->min_size;
+    header.avg_chunk_size = chunking->avg_size;
+    header.max_chunk_size = chunking->max_size;
+  }
+  header.num_of_leaves = num_of_leaves;
+  header.nodes_offset = sizeof(TreeFileHeader);
+  if (num_of_leaves > SIZE_MAX / 8 / max(digest_len, 8u)) {
+    return false;
+  }
+  header.leaves_offset =
+      (header.nodes_offset + num_of_nodes * digest_len + 7) / 8 * 8;
+  header.file_size = header.leaves_offset + num_of_leaves * sizeof(uint64_t);
+  if (chunking != nullptr) {
+    header.chunk_ends_offset = header.file_size;
+    header.file_size += num_of_leaves * sizeof(uint64_t);
+  }
+  return true;
+}
+
+// write a tree file to path. write_level(out, level, size) writes the size
+// digests of a level; chunk_ends are only written with chunking. The file is
+// written next to path and renamed over it, so a reader never sees a partial
+// file.
+template <typename WriteLevel>
+bool write_tree_file(string path, Hasher* hasher, unsigned int arity,
+                     size_t block_size, const ChunkingParams* chunking,
+                     size_t num_of_leaves, const size_t* sorted_leaves,
+                     const size_t* chunk_ends, WriteLevel write_level) {
+  TreeFileHeader header;
+  if (hasher->id() == HASHER_UNKNOWN) {
+    cerr << "Error saving " << path << ": the hasher has no id" << endl;
+    return false;
+  }
+  if (!make_header(header, hasher->id(), hasher->hash_length(), arity,
+                   block_size, chunking, num_of_leaves)) {
+    return false;
+  }
+  string tmp_path = path + ".tmp";
+  ofstream out(tmp_path, ios::binary | ios::trunc);
+  out.write((const char*)&header, sizeof(header));
+  size_t size = num_of_leaves;
+  for (size_t level = 0; size > 0; level++) {
+    write_level(out, level, size);
+    if (size == 1) {
+      break;
+    }
+    size = num_of_blocks(size, arity);
+  }
+  const char padding[8] = {};
+  if (out) {
+    out.write(padding, header.leaves_offset - (uint64_t)out.tellp());
+  }
+  out.write((const char*)sorted_leaves, num_of_leaves * sizeof(uint64_t));
+  if (chunking != nullptr) {
+    out.write((const char*)chunk_ends, num_of_leaves * sizeof(uint64_t));
+  }
+  out.close();
+  if (!out || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    cerr << "Error saving " << path << ": " << strerror(errno) << endl;
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+//
+// Class FlatMerkleTree
+//
+
+// save the tree to a tree file at path
+bool FlatMerkleTree::save(string path) {
+  return write_tree_file(path, hasher, branching_factor, block_len,
+                         chunking_params(), num_of_leaves(), leaf_order(),
+                         leaf_ends(),
+                         [this](ostream& out, size_t level, size_t size) {
+                           // the levels are back to back already, unless
+                           // they are in blocks
+                           if (node_layout == LAYOUT_LEVEL_ORDER) {
+                             out.write((const char*)node_hash(level, 0),
+                                       size * digest_len);
+                             return;
+                           }
+                           for (size_t i = 0; i < size; i++) {
+                             out.write((const char*)node_hash(level, i),
+                                       digest_len);
+                           }
+                         });
+}
+
+// load the tree saved at path
+bool FlatMerkleTree::load(string path) {
+  auto file = make_shared<MappedFile>(path);
+  if (!file->is_open()) {
+    return false;
+  }
+  TreeFileHeader header;
+  TreeFileHeader expected;
+  if (file->size() < sizeof(header)) {
+    cerr << "Error loading " << path << ": not a tree file" << endl;
+    return false;
+  }
+  memcpy(&header, file->data(), sizeof(header));
+  if (memcmp(header.magic, kTreeFileMagic, sizeof(header.magic)) != 0 ||
+      header.version != kTreeFileVersion ||
+      header.byte_order != kTreeFileByteOrder) {
+    cerr << "Error loading " << path << ": not a tree file of version "
+         << kTreeFileVersion << " in this byte order" << endl;
+    return false;
+  }
+  if (header.hasher_id != hasher->id() || header.digest_len != digest_len) {
+    cerr << "Error loading " << path << ": saved with hasher "
+         << header.hasher_id << endl;
+    return false;
+  }
+  // every size is derived from the number of leaves, and has to add up to
+  // the size of the file
+  ChunkingParams saved_chunking = {header.min_chunk_size,
+                                   header.avg_chunk_size,
+                                   header.max_chunk_size};
+  bool saved_content_defined = header.avg_chunk_size != 0;
+  if (!make_header(expected, hasher->id(), digest_len, header.arity,
+                   header.block_size,
+                   saved_content_defined ? &saved_chunking : nullptr,
+                   header.num_of_leaves) ||
+      memcmp(&header, &expected, sizeof(header)) != 0 ||
+      header.file_size != file->size()) {
+    cerr << "Error loading " << path << ": the file is truncated or corrupt"
+         << endl;
+    return false;
+  }
+  // the leaf indices and chunk ends are used in place, so check once that
+  // they stay in bounds
+  size_t num_of_leaves = header.num_of_leaves;
+  const size_t* leaves =
+      (const size_t*)(file->data() + header.leaves_offset);
+  const size_t* ends =
+      (const size_t*)(file->data() + header.chunk_ends_offset);
+  bool valid = true;
+  for (size_t i = 0; i < num_of_leaves && valid; i++) {
+    valid = leaves[i] < num_of_leaves &&
+            (!saved_content_defined || ends[i] > (i == 0 ? 0 : ends[i - 1]));
+  }
+  if (!valid) {
+    cerr << "Error loading " << path << ": the file is corrupt" << endl;
+    return false;
+  }
+  file->random_access();
+  branching_factor = header.arity;
+  block_len = header.block_size;
+  node_layout = LAYOUT_LEVEL_ORDER;
+  blocked_levels.clear();
+  content_defined = saved_content_defined;
+  chunking = saved_chunking;
+  layout_levels(header.num_of_leaves);
+  tree_file = file;
+  saved_nodes_offset = header.nodes_offset;
+  saved_leaves_offset = header.leaves_offset;
+  saved_chunk_ends_offset = header.chunk_ends_offset;
+  vector<unsigned char>().swap(nodes);
+  vector<size_t>().swap(sorted_leaves);
+  vector<size_t>().swap(chunk_ends);
+  return true;
+}
+
+//
+// Class MerkleTree
+//
+
+// save the levels of the tree to a tree file at path
+bool MerkleTree::save(string path) {
+  size_t num_of_leaves = levels.empty() ? 0 : levels[0].size();
+  unsigned int digest_len = hasher->hash_length();
+  vector<size_t> sorted_leaves(num_of_leaves);
+  for (size_t i = 0; i < num_of_leaves; i++) {
+    sorted_leaves[i] = i;
+  }
+  sort(sorted_leaves.begin(), sorted_leaves.end(), [&](size_t a, size_t b) {
+    return memcmp(levels[0][a]->hash, levels[0][b]->hash, digest_len) < 0;
+  });
+  return write_tree_file(path, hasher, 2, block_len, nullptr, num_of_leaves,
+                         sorted_leaves.data(), nullptr,
+                         [&](ostream& out, size_t level, size_t size) {
+                           for (size_t i = 0; i < size; i++) {
+                             out.write((const char*)levels[level][i]->hash,
+                                       digest_len);
+                           }
+                         });
+}
@@ -92,6 +92,7 @@ void hex_string_to_hash(string hash_str, unsigned char* hash, int size) {
 
 SHA_256::SHA_256() {
   digest_size = SHA256_DIGEST_LENGTH;
+  hasher_id = HASHER_SHA_256;
 }
 
 void SHA_256::get_hash(unsigned char* data,
@@ -100,9 +101,18 @@ void SHA_256::get_hash(unsigned char* data,
   SHA256(data, data_len, hash);
 }
 
+// the GPU build does not link cpu_hash_lib; hash the blocks one at a time
+void SHA_256::get_hash(unsigned char* din,
+                       int block_size,
+                       unsigned char* dout,
+                       int num_of_blocks) {
+  Hasher::get_hash(din, block_size, dout, num_of_blocks);
+}
+
 
 MD_5::MD_5() {
   digest_size = MD5_DIGEST_LENGTH;
+  hasher_id = HASHER_MD_5;
 }
 
 void MD_5::get_hash(unsigned char* data,
@@ -192,6 +202,7 @@ MerkleNode::MerkleNode(MerkleNode *lhs, MerkleNode *rhs, Hasher* hasher)
   memcpy(data, lhs->hash, digest_len);
   memcpy(data + digest_len, rhs->hash, digest_len);
   hasher->get_hash(data, digest_len * 2, hash);
+  free(data);
   left = lhs;
   right = rhs;
   lhs->parent = this; // connect parent
@@ -216,6 +227,7 @@ MerkleNode::MerkleNode(MerkleNode cur_node, MerkleNode *sibling, Hasher* hasher)
     memcpy(data + digest_len, sibling->hash, digest_len);
   }
   hasher->get_hash(data, digest_len * 2, hash);
+  free(data);
 }
 
 // make a parent MerkleNode from an existing MerkleNode and its siblings,
@@ -234,6 +246,7 @@ MerkleNode::MerkleNode(MerkleNode cur_node, MerkleNode sibling, Hasher* hasher)
     memcpy(data + digest_len, sibling.hash, digest_len);
   }
   hasher->get_hash(data, digest_len * 2, hash);
+  free(data);
 }
 
 // print the hash of a MerkleNode in hex string format
@@ -0,0 +1,284 @@
+#ifndef STATIC_MERKLE_TREE_HPP
+#define STATIC_MERKLE_TREE_HPP
+
+#include <array>
+#include "merkle_tree.hpp"
+#include "cpu_hash_lib/blake3.h"
+#include "cpu_hash_lib/md5.h"
+#include "cpu_hash_lib/sha256.h"
+#include "cpu_hash_lib/xxh3.h"
+
+// Hash policies of StaticMerkleTree: the digest length as a compile-time
+// constant, and the hash functions as static members the compiler can see
+// through. hash_pair() hashes the parent of two digests inline; the batched
+// functions hash many messages of the same length laid out back to back.
+struct SHA256Policy {
+  static constexpr unsigned int digest_len = 32;
+  static constexpr HasherId id = HASHER_SHA_256;
+
+  static void hash_blocks(const unsigned char* din, size_t block_size,
+                          unsigned char* dout, size_t num_of_blocks) {
+    sha256_multi_buffer(din, block_size, dout, num_of_blocks);
+  }
+  static void hash_pairs(const unsigned char* din, unsigned char* dout,
+                         size_t num_of_pairs) {
+    sha256_multi_buffer(din, digest_len * 2, dout, num_of_pairs);
+  }
+  static void hash_pair(const unsigned char* lhs, const unsigned char* rhs,
+                        unsigned char* dout) {
+    sha256_hash_pair(lhs, rhs, dout);
+  }
+};
+
+struct MD5Policy {
+  static constexpr unsigned int digest_len = 16;
+  static constexpr HasherId id = HASHER_MD_5;
+
+  static void hash_blocks(const unsigned char* din, size_t block_size,
+                          unsigned char* dout, size_t num_of_blocks) {
+    for (size_t i = 0; i < num_of_blocks; i++) {
+      md5(din + i * block_size, block_size, dout + i * digest_len);
+    }
+  }
+  static void hash_pairs(const unsigned char* din, unsigned char* dout,
+                         size_t num_of_pairs) {
+    for (size_t i = 0; i < num_of_pairs; i++) {
+      md5_hash_pair(din + i * digest_len * 2, din + i * digest_len * 2 +
+                    digest_len, dout + i * digest_len);
+    }
+  }
+  static void hash_pair(const unsigned char* lhs, const unsigned char* rhs,
+                        unsigned char* dout) {
+    md5_hash_pair(lhs, rhs, dout);
+  }
+};
+
+struct BLAKE3Policy {
+  static constexpr unsigned int digest_len = 32;
+  static constexpr HasherId id = HASHER_BLAKE_3;
+
+  static void hash_blocks(const unsigned char* din, size_t block_size,
+                          unsigned char* dout, size_t num_of_blocks) {
+    blake3_multi_buffer(din, block_size, dout, num_of_blocks);
+  }
+  static void hash_pairs(const unsigned char* din, unsigned char* dout,
+                         size_t num_of_pairs) {
+    blake3_multi_buffer(din, digest_len * 2, dout, num_of_pairs);
+  }
+  static void hash_pair(const unsigned char* lhs, const unsigned char* rhs,
+                        unsigned char* dout) {
+    unsigned char pair[digest_len * 2];
+    memcpy(pair, lhs, digest_len);
+    memcpy(pair + digest_len, rhs, digest_len);
+    blake3(pair, digest_len * 2, dout);
+  }
+};
+
+struct XXH3Policy {
+  static constexpr unsigned int digest_len = 16;
+  static constexpr HasherId id = HASHER_XXH3_128;
+
+  static void hash_blocks(const unsigned char* din, size_t block_size,
+                          unsigned char* dout, size_t num_of_blocks) {
+    for (size_t i = 0; i < num_of_blocks; i++) {
+      xxh3_128(din + i * block_size, block_size, dout + i * digest_len);
+    }
+  }
+  static void hash_pairs(const unsigned char* din, unsigned char* dout,
+                         size_t num_of_pairs) {
+    hash_blocks(din, digest_len * 2, dout, num_of_pairs);
+  }
+  static void hash_pair(const unsigned char* lhs, const unsigned char* rhs,
+                        unsigned char* dout) {
+    unsigned char pair[digest_len * 2];
+    memcpy(pair, lhs, digest_len);
+    memcpy(pair + digest_len, rhs, digest_len);
+    xxh3_128(pair, digest_len * 2, dout);
+  }
+};
+
+// A FlatMerkleTree with the hash algorithm fixed at compile time by Policy
+// instead of a Hasher*. Digests are std::array values of Policy::digest_len
+// bytes, and proofs are walked with the inlined Policy::hash_pair(), with no
+// virtual call or runtime digest length on the way. The tree has the same
+// shape, and so the same root, as a MerkleTree with the matching Hasher.
+// A FixedBlockSize other than 0 fixes the bytes per leaf at compile time as
+// well; otherwise each tree takes its own block size when it is made.
+template <typename Policy, size_t FixedBlockSize = 0>
+class StaticMerkleTree {
+ public:
+  static constexpr unsigned int digest_len = Policy::digest_len;
+  using Digest = std::array<unsigned char, digest_len>;
+  static_assert(sizeof(Digest) == digest_len, "digests are packed");
+
+ private:
+  unsigned int num_threads = 1;
+  // bytes of data per leaf, unless FixedBlockSize is set
+  size_t block_len = BLOCK_SIZE;
+  // every level, leaves first; an orphan is copied to the next level
+  std::vector<std::vector<Digest>> levels;
+  // leaf indices sorted by their digests
+  std::vector<size_t> sorted_leaves;
+
+  // hash data block by block into the leaves; the last short block is
+  // zero-padded, as hash_blocks() does
+  void hash_leaves(unsigned char* data, size_t data_len, ThreadPool& pool) {
+    std::vector<Digest>& leaves = levels[0];
+    const size_t block_size = this->block_size();
+    size_t num_of_full_blocks = data_len / block_size;
+    pool.parallel_for(num_of_full_blocks, [&](size_t begin, size_t end) {
+      Policy::hash_blocks(data + begin * block_size, block_size,
+                          leaves[begin].data(), end - begin);
+    });
+    size_t offset = num_of_full_blocks * block_size;
+    if (offset < data_len) {
+      std::vector<unsigned char> last_block(block_size, 0);
+      memcpy(last_block.data(), data + offset, data_len - offset);
+      Policy::hash_blocks(last_block.data(), block_size,
+                          leaves[num_of_full_blocks].data(), 1);
+    }
+  }
+
+  void make_tree_from_data(unsigned char* data, size_t data_len) {
+    size_t num_of_leaves = num_of_blocks(data_len, block_size());
+    levels.assign(1, std::vector<Digest>(num_of_leaves));
+    if (num_of_leaves == 0) {
+      return;
+    }
+    ThreadPool pool(num_threads);
+    hash_leaves(data, data_len, pool);
+    sorted_leaves.resize(num_of_leaves);
+    for (size_t i = 0; i < num_of_leaves; i++) {
+      sorted_leaves[i] = i;
+    }
+    std::sort(sorted_leaves.begin(), sorted_leaves.end(),
+              [this](size_t a, size_t b) {
+                return levels[0][a] < levels[0][b];
+              });
+    while (levels.back().size() > 1) {
+      const std::vector<Digest>& cur = levels.back();
+      std::vector<Digest> next((cur.size() + 1) / 2);
+      // siblings are adjacent, so the pairs are hashed in place
+      pool.parallel_for(cur.size() / 2, [&](size_t begin, size_t end) {
+        Policy::hash_pairs(cur[begin * 2].data(), next[begin].data(),
+                           end - begin);
+      });
+      if (cur.size() % 2 != 0) {
+        next.back() = cur.back();
+      }
+      levels.push_back(std::move(next));
+    }
+  }
+
+ public:
+  StaticMerkleTree() : levels(1) {}
+  StaticMerkleTree(unsigned char* data, size_t data_len,
+                   unsigned int num_threads_ = 1)
+      : num_threads(std::max(num_threads_, 1u)) {
+    make_tree_from_data(data, data_len);
+  }
+  // a tree of block_size_ bytes per leaf, without a FixedBlockSize
+  StaticMerkleTree(unsigned char* data, size_t data_len,
+                   unsigned int num_threads_, size_t block_size_)
+      : num_threads(std::max(num_threads_, 1u)),
+        block_len(std::max<size_t>(block_size_, 1)) {
+    static_assert(FixedBlockSize == 0, "the block size is fixed already");
+    make_tree_from_data(data, data_len);
+  }
+
+  size_t block_size() const {
+    return FixedBlockSize != 0 ? FixedBlockSize : block_len;
+  }
+  size_t num_of_leaves() const { return levels[0].size(); }
+  size_t num_of_levels() const { return levels.size(); }
+  const Digest& node(size_t level, size_t index) const {
+    return levels[level][index];
+  }
+  // only for a tree with leaves
+  const Digest& root() const { return levels.back()[0]; }
+  std::string root_hash() const {
+    if (num_of_leaves() == 0) {
+      return "";
+    }
+    return hash_to_hex_string((unsigned char*)root().data(), digest_len);
+  }
+
+  // return the index of the leaf with digest hash, or num_of_leaves() if none
+  size_t find_leaf(const Digest& hash) const {
+    auto it = std::lower_bound(sorted_leaves.begin(), sorted_leaves.end(),
+                               hash, [this](size_t leaf, const Digest& key) {
+                                 return levels[0][leaf] < key;
+                               });
+    if (it == sorted_leaves.end() || levels[0][*it] != hash) {
+      return num_of_leaves();
+    }
+    return *it;
+  }
+
+  // the proof of a leaf in raw digests, as FlatMerkleTree::find_proof()
+  MerkleProof find_proof(size_t leaf_index) const {
+    MerkleProof proof;
+    if (leaf_index >= num_of_leaves()) {
+      return proof;
+    }
+    proof.leaf_hash.assign(levels[0][leaf_index].begin(),
+                           levels[0][leaf_index].end());
+    size_t index = leaf_index;
+    for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+      size_t sibling = index ^ 1;
+      if (sibling < levels[level].size()) {
+        const Digest& hash = levels[level][sibling];
+        proof.sibling_hashes.insert(proof.sibling_hashes.end(), hash.begin(),
+                                    hash.end());
+        proof.lrs.push_back(sibling < index ? LEFT : RIGHT);
+      }
+      index /= 2;
+    }
+    return proof;
+  }
+
+  // check a proof against root, hashing each level inline
+  static bool verify_proof(const MerkleProof& proof, const Digest& root) {
+    if (proof.leaf_hash.size() != digest_len ||
+        proof.sibling_hashes.size() != proof.lrs.size() * digest_len) {
+      return false;
+    }
+    Digest cur;
+    memcpy(cur.data(), proof.leaf_hash.data(), digest_len);
+    for (size_t i = 0; i < proof.lrs.size(); i++) {
+      const unsigned char* sibling = proof.sibling_hashes.data() +
+                                     i * digest_len;
+      if (proof.lrs[i] == LEFT) {
+        Policy::hash_pair(sibling, cur.data(), cur.data());
+      } else {
+        Policy::hash_pair(cur.data(), sibling, cur.data());
+      }
+    }
+    return cur == root;
+  }
+
+  // verify whether a leaf with digest hash is in the tree, walking up from
+  // it with its siblings
+  bool verify(const Digest& hash) const {
+    size_t index = find_leaf(hash);
+    if (index == num_of_leaves()) {
+      return false;
+    }
+    Digest cur = hash;
+    for (size_t level = 0; level + 1 < num_of_levels(); level++) {
+      size_t sibling = index ^ 1;
+      if (sibling < levels[level].size()) {
+        const Digest& other = levels[level][sibling];
+        if (sibling < index) {
+          Policy::hash_pair(other.data(), cur.data(), cur.data());
+        } else {
+          Policy::hash_pair(cur.data(), other.data(), cur.data());
+        }
+      }
+      index /= 2;
+    }
+    return cur == root();
+  }
+};
+
+#endif /* STATIC_MERKLE_TREE_HPP */
@@ -0,0 +1,82 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.hpp"
+
+using namespace std;
+
+MappedFile::MappedFile(string path, bool huge_pages) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Error opening " << path << ": " << strerror(errno) << endl;
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cerr << "Error reading the size of " << path << ": " << strerror(errno)
+         << endl;
+    close(fd);
+    return;
+  }
+  file_size = st.st_size;
+  if (file_size == 0) {
+    // an empty file cannot be mapped, but it is still a valid input
+    close(fd);
+    opened = true;
+    return;
+  }
+  void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    cerr << "Error mapping " << path << ": " << strerror(errno) << endl;
+    file_size = 0;
+    return;
+  }
+  file_data = (unsigned char*)addr;
+  opened = true;
+  // only hints; a kernel without them still reads the file correctly
+  madvise(file_data, file_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  if (huge_pages) {
+    madvise(file_data, file_size, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+MappedFile::~MappedFile() {
+  if (file_data != nullptr) {
+    munmap(file_data, file_size);
+  }
+}
+
+bool MappedFile::is_open() const { return opened; }
+
+unsigned char* MappedFile::data() const { return file_data; }
+
+size_t MappedFile::size() const { return file_size; }
+
+void MappedFile::release(size_t offset, size_t len) {
+  if (file_data == nullptr || offset >= file_size) {
+    return;
+  }
+  // madvise works on whole pages; keep the partial pages at both ends
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t begin = (offset + page_size - 1) / page_size * page_size;
+  size_t end = min(offset + len, file_size);
+  if (end != file_size) {
+    end = end / page_size * page_size;
+  }
+  if (begin < end) {
+    madvise(file_data + begin, end - begin, MADV_DONTNEED);
+  }
+}
+
+void MappedFile::random_access() {
+  if (file_data != nullptr) {
+    madvise(file_data, file_size, MADV_RANDOM);
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+
+// A file mapped read-only into memory. Its pages are read from the page cache
+// on first touch instead of being copied into a buffer, and can be dropped
+// again with release() once they are no longer needed.
+class MappedFile {
+ private:
+  unsigned char* file_data = nullptr;
+  size_t file_size = 0;
+  bool opened = false;
+
+ public:
+  // map the file at path, hinting the kernel that it is read sequentially;
+  // huge_pages asks for transparent huge pages where the kernel supports
+  // them for files
+  MappedFile(std::string path, bool huge_pages = false);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool is_open() const;
+  unsigned char* data() const;
+  size_t size() const;
+  // drop the pages of [offset, offset + len) from this process; touching
+  // them again reads them back from the file
+  void release(size_t offset, size_t len);
+  // hint the kernel that the file is read in no particular order, so it
+  // does not read ahead
+  void random_access();
+};
+
+#endif /* MAPPED_FILE_HPP */
@@ -4,6 +4,11 @@ using namespace std;
 namespace fs = filesystem;
 
 void TestData::generate_test_data() {
+  data = new unsigned char[data_len];
+  if (data == nullptr) {
+    cerr << "Error allocating memory of size " << data_len << " bytes!" << endl;
+    exit(1);
+  }
   default_random_engine rng(random_seed);
   uniform_int_distribution<int> rng_dist(0, 255);
 
@@ -33,9 +38,16 @@ bool TestData::load_test_data() {
     cerr << "Cache not found at: " << fs::absolute(p) << endl;
     return false;
   }
-  ifstream is;
-  is.open(p, ios::binary);
-  is.read((char *)data, data_len);
+  // map the cache instead of reading it into a buffer; pages are read as
+  // they are hashed
+  cache_file = new MappedFile(p.string());
+  if (!cache_file->is_open() || cache_file->size() != data_len) {
+    cerr << "Cache is not usable at: " << fs::absolute(p) << endl;
+    delete cache_file;
+    cache_file = nullptr;
+    return false;
+  }
+  data = cache_file->data();
   return true;
 }
 
@@ -43,18 +55,18 @@ TestData::TestData(unsigned long long data_len_, unsigned long long block_size_,
                    string platform_, string cache_path_)
     : data_len(data_len_), block_size(block_size_), platform(platform_),
       cache_path(cache_path_) {
-  data = new unsigned char[data_len];
-  if (data == nullptr) {
-    cerr << "Error allocating memory of size " << data_len << " bytes!" << endl;
-    exit(1);
-  }
   config = platform + "," + to_string(data_len) + "," + to_string(block_size);
 }
 
-TestData::~TestData() { delete data; }
+TestData::~TestData() {
+  if (cache_file != nullptr) {
+    delete cache_file;
+  } else {
+    delete[] data;
+  }
+}
 
 tuple<string, unsigned char *, unsigned long long> TestData::make_test_data() {
-  assert(data != nullptr);
   if (!load_test_data()) {
     generate_test_data();
   }
@@ -63,7 +75,6 @@ tuple<string, unsigned char *, unsigned long long> TestData::make_test_data() {
 }
 
 tuple<string, unsigned char *, unsigned long long> TestData::get_test_data() {
-  assert(data != nullptr);
   if (!data_loaded) {
     return make_test_data();
   }
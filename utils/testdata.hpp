@@ -7,12 +7,15 @@
 #include <iostream>
 #include <random>
 #include <string>
+#include "mapped_file.hpp"
 
 class TestData {
  private:
   int random_seed = 42;
   std::string config = "";
   unsigned char* data = nullptr;
+  // the cache file data is mapped from, if it was loaded from the cache
+  MappedFile* cache_file = nullptr;
   unsigned long long data_len = 0;
   unsigned long long block_size = 0;
   std::string platform = "";